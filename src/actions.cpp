@@ -25,6 +25,7 @@
 #include "actions.hpp"
 #include "syntax_highlight.hpp"
 #include "utils.hpp"
+#include "simd.hpp"
 #include "files.hpp"
 #include "markups.hpp"
 #include "state.hpp"
@@ -95,7 +96,8 @@ namespace quickbook
             bool valid = true;
             std::string id = get_attribute_value(state, id_value);
 
-            // Special case since I use dollar ids for id placeholders.
+            // Dollar ids were used for id placeholders in older versions,
+            // so they're still rejected.
             if (id[0] == '$') { valid = false; id[0] = '_'; }
 
             if (qbk_version_n >= 107u) {
@@ -303,7 +305,7 @@ namespace quickbook
         detail::markup markup = detail::get_markup(block.get_tag());
 
         value_consumer values = block;
-        state.out << markup.pre << values.consume().get_encoded() << markup.post;
+        state.out << markup.pre << values.consume().get_encoded_view() << markup.post;
         values.finish();
     }
 
@@ -322,7 +324,7 @@ namespace quickbook
         detail::markup markup = detail::get_markup(phrase.get_tag());
 
         value_consumer values = phrase;
-        state.phrase << markup.pre << values.consume().get_encoded() << markup.post;
+        state.phrase << markup.pre << values.consume().get_encoded_view() << markup.post;
         values.finish();
     }
 
@@ -341,7 +343,7 @@ namespace quickbook
                 state.phrase.get());
         state.phrase
             << "\">"
-            << phrase.get_encoded()
+            << phrase.get_encoded_view()
             << "</phrase>";
     }
 
@@ -354,7 +356,7 @@ namespace quickbook
             << "<footnote id=\""
             << state.document.add_id("f", id_category::numbered)
             << "\"><para>"
-            << values.consume().get_encoded()
+            << values.consume().get_encoded_view()
             << "</para></footnote>";
         values.finish();
     }
@@ -460,7 +462,7 @@ namespace quickbook
                 id_category::explicit_id);
 
             write_bridgehead(state, level,
-                content.get_encoded(), anchor, self_linked_headers);
+                content.get_encoded(), anchor, state.self_linked_headers);
         }
         else if (state.document.compatibility_version() >= 106u)
         {
@@ -471,7 +473,7 @@ namespace quickbook
                 id_category::generated_heading);
 
             write_bridgehead(state, level,
-                content.get_encoded(), anchor, self_linked_headers);
+                content.get_encoded(), anchor, state.self_linked_headers);
         }
         else
         {
@@ -495,7 +497,7 @@ namespace quickbook
                     state.document.add_id(id, id_category::generated_heading);
 
                 write_bridgehead(state, level,
-                    content.get_encoded(), anchor, self_linked_headers);
+                    content.get_encoded(), anchor, state.self_linked_headers);
             }
             else {
                 std::string anchor =
@@ -526,7 +528,7 @@ namespace quickbook
         values.finish();
 
         state.phrase << markup.pre;
-        state.phrase << content.get_encoded();
+        state.phrase << content.get_encoded_view();
         state.phrase << markup.post;
     }
 
@@ -583,12 +585,12 @@ namespace quickbook
         assert(mark == '*' || mark == '#');
         out << ((mark == '#') ? "\n</orderedlist>" : "\n</itemizedlist>");
 
-        std::string list_output;
+        string_rope list_output;
         out.swap(list_output);
 
         pop_output();
 
-        (in_list ? phrase : out) << list_output;
+        (in_list ? phrase : out).splice(list_output);
 
         pop_tagged_source_mode();
     }
@@ -696,7 +698,7 @@ namespace quickbook
         BOOST_FOREACH(value item, list)
         {
             state.out << "<listitem>";
-            state.out << item.get_encoded();
+            state.out << item.get_encoded_view();
             state.out << "</listitem>";
         }
 
@@ -720,13 +722,13 @@ namespace quickbook
         if (str == quickbook_get_date)
         {
             char strdate[64];
-            strftime(strdate, sizeof(strdate), "%Y-%b-%d", current_time);
+            strftime(strdate, sizeof(strdate), "%Y-%b-%d", &state.current_time);
             state.phrase << strdate;
         }
         else if (str == quickbook_get_time)
         {
             char strdate[64];
-            strftime(strdate, sizeof(strdate), "%I:%M:%S %p", current_time);
+            strftime(strdate, sizeof(strdate), "%I:%M:%S %p", &state.current_time);
             state.phrase << strdate;
         }
         else
@@ -816,8 +818,9 @@ namespace quickbook
             if (qbk_version_n >= 107u) state.phrase << state.end_callouts();
 
             if (!inline_code) {
-                state.out << state.phrase.str();
-                state.phrase.clear();
+                string_rope code;
+                state.phrase.swap(code);
+                state.out.splice(code);
             }
         }
         else {
@@ -841,8 +844,8 @@ namespace quickbook
     {
         write_anchors(state, state.phrase);
 
-        while (first != last)
-            detail::print_char(*first++, state.phrase.get());
+        detail::print_string(quickbook::string_view(first.base(),
+                last.base() - first.base()), state.phrase.get());
     }
 
     void escape_unicode_action::operator()(parse_iterator first, parse_iterator last) const
@@ -872,16 +875,22 @@ namespace quickbook
     {
         if (v.is_encoded())
         {
-            detail::print_string(v.get_encoded(), out);
+            detail::print_string(v.get_encoded_view(), out);
         }
         else {
+            // Backslashes escape the following character.
             quickbook::string_view value = v.get_quickbook();
-            for(string_iterator
-                first = value.begin(), last  = value.end();
-                first != last; ++first)
+            char const* first = value.data();
+            char const* last = first + value.size();
+
+            for (;;)
             {
-                if (*first == '\\' && ++first == last) break;
-                detail::print_char(*first, out);
+                char const* slash = simd::find(first, last, '\\');
+                detail::print_string(
+                    quickbook::string_view(first, slash - first), out);
+                if (slash == last || ++slash == last) break;
+                detail::print_char(*slash, out);
+                first = slash + 1;
             }
         }
     }
@@ -995,7 +1004,7 @@ namespace quickbook
            //
            fs::path img = detail::generic_to_path(fileref);
            if (!img.has_root_directory())
-              img = quickbook::image_location / img;  // relative path
+              img = state.image_location / img;  // relative path
 
            //
            // Now load the SVG file:
@@ -1312,7 +1321,7 @@ namespace quickbook
 
         if (symbol->content.is_encoded())
         {
-            (is_block ? state.out : state.phrase) << symbol->content.get_encoded();
+            (is_block ? state.out : state.phrase) << symbol->content.get_encoded_view();
             return;
         }
 
@@ -1325,8 +1334,8 @@ namespace quickbook
 
         {
             state_save save(state, state_save::scope_callables);
-            std::string save_block;
-            std::string save_phrase;
+            string_rope save_block;
+            string_rope save_phrase;
 
             state.templates.start_template(symbol);
 
@@ -1395,12 +1404,12 @@ namespace quickbook
 
                 if(is_block || !save_block.empty()) {
                     paragraph_action();
-                    state.out << save_block;
-                    state.phrase << save_phrase;
+                    state.out.splice(save_block);
+                    state.phrase.splice(save_phrase);
                     paragraph_action();
                 }
                 else {
-                    state.phrase << save_phrase;
+                    state.phrase.splice(save_phrase);
                 }
             }
             else
@@ -1469,7 +1478,7 @@ namespace quickbook
 
             if (symbol->content.is_encoded())
             {
-                state.phrase << symbol->content.get_encoded();
+                state.phrase << symbol->content.get_encoded_view();
             }
             else
             {
@@ -1589,7 +1598,7 @@ namespace quickbook
         if (content.empty())
             detail::print_string(dst, state.phrase.get());
         else
-            state.phrase << content.get_encoded();
+            state.phrase << content.get_encoded_view();
 
         state.phrase << markup.post;
     }
@@ -1612,13 +1621,13 @@ namespace quickbook
             
             if(entry.check()) {
                 state.out << "<term>";
-                state.out << entry.consume().get_encoded();
+                state.out << entry.consume().get_encoded_view();
                 state.out << "</term>";
             }
             
             if(entry.check()) {
                 state.out << "<listitem>";
-                BOOST_FOREACH(value phrase, entry) state.out << phrase.get_encoded();
+                BOOST_FOREACH(value phrase, entry) state.out << phrase.get_encoded_view();
                 state.out << "</listitem>";
             }
 
@@ -1681,7 +1690,7 @@ namespace quickbook
                 detail::print_string(title.get_quickbook(), state.out.get());
             }
             else {
-                state.out << title.get_encoded();
+                state.out << title.get_encoded_view();
             }
             state.out << "</title>";
         }
@@ -1699,7 +1708,7 @@ namespace quickbook
         {
             state.out << "<thead>" << "<row>";
             BOOST_FOREACH(value cell, values.consume()) {
-                state.out << "<entry>" << cell.get_encoded() << "</entry>";
+                state.out << "<entry>" << cell.get_encoded_view() << "</entry>";
             }
             state.out << "</row>\n" << "</thead>\n";
         }
@@ -1709,7 +1718,7 @@ namespace quickbook
         BOOST_FOREACH(value row, values) {
             state.out << "<row>";
             BOOST_FOREACH(value cell, row) {
-                state.out << "<entry>" << cell.get_encoded() << "</entry>";
+                state.out << "<entry>" << cell.get_encoded_view() << "</entry>";
             }
             state.out << "</row>\n";
         }
@@ -1756,7 +1765,7 @@ namespace quickbook
 
             write_anchors(state, state.out);
 
-            if (self_linked_headers && state.document.compatibility_version() >= 103)
+            if (state.self_linked_headers && state.document.compatibility_version() >= 103)
             {
                 state.out << quickbook::detail::linkify(title, full_id);
             }
@@ -2000,7 +2009,7 @@ namespace quickbook
     {
         std::string value;
 
-        if (!state.out.str().empty())
+        if (!state.out.empty())
         {
             paragraph_action para(state);
             para(); // For paragraphs before the template call.
@@ -8,60 +8,174 @@
 =============================================================================*/
 #include "collector.hpp"
 #include <boost/assert.hpp>
+#include <boost/foreach.hpp>
 
 namespace quickbook
 {
+    namespace
+    {
+        // Text shorter than this is copied rather than spliced, to avoid
+        // creating lots of small chunks.
+        std::string::size_type const min_splice_size = 256;
+    }
+
+    string_rope::string_rope()
+        : chunks_()
+        , tail_()
+    {}
+
+    bool string_rope::empty() const
+    {
+        // Chunks are never empty.
+        return chunks_.empty() && tail_.empty();
+    }
+
+    std::string const& string_rope::str() const
+    {
+        if (!chunks_.empty()) {
+            std::string::size_type size = tail_.size();
+            BOOST_FOREACH(std::string const& chunk, chunks_) {
+                size += chunk.size();
+            }
+
+            std::string joined;
+            joined.reserve(size);
+            BOOST_FOREACH(std::string const& chunk, chunks_) {
+                joined += chunk;
+            }
+            joined += tail_;
+
+            chunks_.clear();
+            tail_.swap(joined);
+        }
+
+        return tail_;
+    }
+
+    void string_rope::clear()
+    {
+        chunks_.clear();
+        tail_.clear();
+    }
+
+    void string_rope::swap(string_rope& other)
+    {
+        chunks_.swap(other.chunks_);
+        tail_.swap(other.tail_);
+    }
+
+    void string_rope::swap(std::string& other)
+    {
+        str();
+        tail_.swap(other);
+    }
+
+    void string_rope::add_chunk(std::string& x)
+    {
+        if (!x.empty()) {
+            chunks_.push_back(std::string());
+            chunks_.back().swap(x);
+        }
+    }
+
+    void string_rope::splice(string_rope& x)
+    {
+        if (empty()) {
+            swap(x);
+        }
+        else if (x.chunks_.empty() && x.tail_.size() < min_splice_size) {
+            tail_ += x.tail_;
+        }
+        else {
+            add_chunk(tail_);
+            chunks_.reserve(chunks_.size() + x.chunks_.size() + 1);
+            BOOST_FOREACH(std::string& chunk, x.chunks_) {
+                add_chunk(chunk);
+            }
+            add_chunk(x.tail_);
+        }
+
+        x.clear();
+    }
+
+    void string_rope::splice(std::string& x)
+    {
+        if (empty()) {
+            tail_.swap(x);
+        }
+        else if (x.size() < min_splice_size) {
+            tail_ += x;
+        }
+        else {
+            add_chunk(tail_);
+            add_chunk(x);
+        }
+
+        x.clear();
+    }
+
     string_stream::string_stream()
-        : buffer_ptr(new std::string())
-        , stream_ptr(new ostream(boost::iostreams::back_inserter(*buffer_ptr.get())))
+        : rope_()
+        , streambuf_(rope_.tail_)
+        , stream_(&streambuf_)
     {}
 
-    string_stream::string_stream(string_stream const& other)
-        : buffer_ptr(other.buffer_ptr)
-        , stream_ptr(other.stream_ptr)
+    string_stream::~string_stream()
     {}
-    
-    string_stream&
-    string_stream::operator=(string_stream const& other)
+
+    string_stream::streambuf::int_type
+    string_stream::streambuf::overflow(int_type c)
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            buffer_ += traits_type::to_char_type(c);
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize
+    string_stream::streambuf::xsputn(char const* s, std::streamsize n)
     {
-        buffer_ptr = other.buffer_ptr;
-        stream_ptr = other.stream_ptr;
-        return *this;
+        buffer_.append(s, static_cast<std::string::size_type>(n));
+        return n;
     }
-        
+
     collector::collector()
-        : main(default_)
-        , top(default_)
+        : streams()
+        , depth(0)
+        , main(&default_)
+        , top(&default_)
     {
     }
 
     collector::collector(string_stream& out)
-        : main(out) 
-        , top(out) 
+        : streams()
+        , depth(0)
+        , main(&out) 
+        , top(&out) 
     {
     }
     
     collector::~collector()
     {
-        BOOST_ASSERT(streams.empty()); // assert there are no more pushes than pops!!!
+        BOOST_ASSERT(!depth); // assert there are no more pushes than pops!!!
     }
     
     void 
     collector::push()
     {
-        streams.push(string_stream());
-        top = boost::ref(streams.top());
+        if (depth == streams.size())
+            streams.push_back(boost::shared_ptr<string_stream>(
+                new string_stream()));
+        else
+            streams[depth]->clear();
+
+        top = streams[depth++].get();
     }
     
     void 
     collector::pop()
     {
-        BOOST_ASSERT(!streams.empty());
-        streams.pop();
-
-        if (streams.empty())
-            top = boost::ref(main);
-        else
-            top = boost::ref(streams.top());
+        BOOST_ASSERT(depth);
+        --depth;
+        top = depth ? streams[depth - 1].get() : main;
     }
 }
@@ -10,55 +10,114 @@
 #define BOOST_SPIRIT_QUICKBOOK_COLLECTOR_HPP
 
 #include <string>
-#include <stack>
-#include <boost/ref.hpp>
+#include <vector>
+#include <ostream>
+#include <streambuf>
 #include <boost/shared_ptr.hpp>
 #include <boost/noncopyable.hpp>
-#include <boost/iostreams/device/back_inserter.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
+#include "string_view.hpp"
 
 namespace quickbook
 {
-    struct string_stream
+    // Text which is stored as a sequence of separately allocated chunks,
+    // so that other text can be spliced onto it without copying. It's only
+    // joined into a single string when that's needed.
+
+    struct string_rope
     {
-        typedef boost::iostreams::filtering_ostream ostream;
+        string_rope();
+
+        bool empty() const;
+        std::string const& str() const;
+        void clear();
+
+        void swap(string_rope&);
+        void swap(std::string&);
+
+        void append(quickbook::string_view x)
+        {
+            tail_.append(x.data(), x.size());
+        }
+
+        // Move the contents of 'x' onto the end of this, leaving 'x'
+        // empty. Large amounts of text are moved without copying.
+        void splice(string_rope& x);
+        void splice(std::string& x);
+
+    private:
+        void add_chunk(std::string&);
+
+        // The text is the chunks followed by 'tail_', which is what
+        // gets appended to.
+        mutable std::vector<std::string> chunks_;
+        mutable std::string tail_;
+
+        friend struct string_stream;
+    };
+
+    // A string_rope that can be written to as an ostream. The ostream's
+    // streambuf appends directly to the rope, so there's nothing to flush,
+    // and strings can be appended without going through it.
 
+    struct string_stream : boost::noncopyable
+    {
         string_stream();
-        string_stream(string_stream const& other);
-        string_stream& operator=(string_stream const& other);
+        ~string_stream();
 
         std::string const& str() const
         {
-            stream_ptr->flush();
-            return *buffer_ptr.get();
+            return rope_.str();
+        }
+
+        bool empty() const
+        {
+            return rope_.empty();
         }
     
         std::ostream& get() const
         {
-            return *stream_ptr.get();
+            return stream_;
         }
     
         void clear()
         {
-            buffer_ptr->clear();
+            rope_.clear();
         }
 
         void swap(std::string& other)
         {
-            stream_ptr->flush();
-            std::swap(other, *buffer_ptr.get());
+            rope_.swap(other);
         }
 
-        void append(std::string const& other)
+        void swap(string_rope& other)
         {
-            stream_ptr->flush();
-            *buffer_ptr.get() += other;
+            rope_.swap(other);
         }
 
-    private:
+        void append(quickbook::string_view other)
+        {
+            rope_.append(other);
+        }
 
-        boost::shared_ptr<std::string> buffer_ptr;
-        boost::shared_ptr<ostream> stream_ptr;
+        void splice(string_rope& other)
+        {
+            rope_.splice(other);
+        }
+
+    private:
+        struct streambuf : std::streambuf
+        {
+            explicit streambuf(std::string& buffer) : buffer_(buffer) {}
+        protected:
+            virtual int_type overflow(int_type c);
+            virtual std::streamsize xsputn(char const*, std::streamsize);
+        private:
+            std::string& buffer_;
+        };
+
+        string_rope rope_;
+        streambuf streambuf_;
+        mutable std::ostream stream_;
     };
 
     struct collector : boost::noncopyable
@@ -72,34 +131,53 @@ namespace quickbook
 
         std::ostream& get() const
         {
-            return top.get().get();
+            return top->get();
         }
         
         std::string const& str() const
         {
-            return top.get().str();
+            return top->str();
+        }
+
+        bool empty() const
+        {
+            return top->empty();
         }
         
         void clear()
         {
-            top.get().clear();
+            top->clear();
         }
         
         void swap(std::string& other)
         {
-            top.get().swap(other);
+            top->swap(other);
         }
 
-        void append(std::string const& other)
+        void swap(string_rope& other)
         {
-            top.get().append(other);
+            top->swap(other);
+        }
+
+        void append(quickbook::string_view other)
+        {
+            top->append(other);
+        }
+
+        void splice(string_rope& other)
+        {
+            top->splice(other);
         }
 
     private:
 
-        std::stack<string_stream> streams;
-        boost::reference_wrapper<string_stream> main;
-        boost::reference_wrapper<string_stream> top;
+        // The streams for 'push', the first 'depth' are in use. Popped
+        // streams are kept, so that they, and their buffers, can be
+        // reused by the next push.
+        std::vector<boost::shared_ptr<string_stream> > streams;
+        std::size_t depth;
+        string_stream* main;
+        string_stream* top;
         string_stream default_;
     };
     
@@ -117,6 +195,27 @@ namespace quickbook
         out.append(val);
         return out;
     }
+
+    inline collector& 
+    operator<<(collector& out, quickbook::string_view val)
+    {
+        out.append(val);
+        return out;
+    }
+
+    inline collector& 
+    operator<<(collector& out, char const* val)
+    {
+        out.append(val);
+        return out;
+    }
+
+    inline collector& 
+    operator<<(collector& out, char val)
+    {
+        out.append(quickbook::string_view(&val, 1));
+        return out;
+    }
 }
 
 #endif // BOOST_SPIRIT_QUICKBOOK_COLLECTOR_HPP
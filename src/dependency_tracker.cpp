@@ -8,7 +8,8 @@
 
 #include "dependency_tracker.hpp"
 #include "path.hpp"
-#include <boost/filesystem/operations.hpp>
+#include "files.hpp"
+#include "glob.hpp"
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
 
@@ -57,12 +58,42 @@ namespace quickbook
         return generic;
     }
 
+    // Does 'path' match the start of 'pattern'? If 'is_glob' is true, the
+    // pattern's elements can contain glob characters.
+    static bool match_path_prefix(fs::path const& path,
+            fs::path const& pattern, bool is_glob)
+    {
+        fs::path::const_iterator it = pattern.begin(), end = pattern.end();
+
+        BOOST_FOREACH(fs::path const& element, path)
+        {
+            if (it == end) return false;
+
+            if (is_glob) {
+                std::string glob_text = detail::path_to_generic(*it);
+                std::string name = detail::path_to_generic(element);
+
+                if (find_glob_char(glob_text) == std::string::npos ?
+                        glob_unescape(glob_text) != name :
+                        !quickbook::glob(glob_text, name))
+                    return false;
+            }
+            else if (*it != element) {
+                return false;
+            }
+
+            ++it;
+        }
+
+        return true;
+    }
+
     dependency_tracker::dependency_tracker() :
         dependencies(), glob_dependencies(),
         last_glob(glob_dependencies.end()) {}
 
     bool dependency_tracker::add_dependency(fs::path const& f) {
-        bool found = fs::exists(fs::status(f));
+        bool found = file_exists(f);
         dependencies[f] |= found;
         return found;
     }
@@ -115,27 +146,86 @@ namespace quickbook
             }
         }
         else {
-            std::set<std::string> paths;
+            BOOST_FOREACH(std::string const& p, get_dependencies(f))
+            {
+                out << p << std::endl;
+            }
+        }
+    }
 
-            BOOST_FOREACH(dependency_list::value_type const& d, dependencies)
+    std::set<std::string> dependency_tracker::get_dependencies(flags f) const
+    {
+        std::set<std::string> paths;
+
+        BOOST_FOREACH(dependency_list::value_type const& d, dependencies)
+        {
+            if (d.second) {
+                paths.insert(get_path(d.first, f));
+            }
+        }
+
+        BOOST_FOREACH(glob_list::value_type const& g, glob_dependencies)
+        {
+            BOOST_FOREACH(fs::path const& p, g.second)
             {
-                if (d.second) {
-                    paths.insert(get_path(d.first, f));
-                }
+                paths.insert(get_path(p, f));
             }
+        }
 
-            BOOST_FOREACH(glob_list::value_type const& g, glob_dependencies)
+        return paths;
+    }
+
+    std::set<fs::path> dependency_tracker::get_directories() const
+    {
+        std::set<fs::path> directories;
+
+        BOOST_FOREACH(dependency_list::value_type const& d, dependencies)
+        {
+            directories.insert(d.first.parent_path());
+        }
+
+        BOOST_FOREACH(glob_list::value_type const& g, glob_dependencies)
+        {
+            // The directory where the glob starts matching.
+            fs::path base;
+            BOOST_FOREACH(fs::path const& element, g.first.parent_path())
             {
-                BOOST_FOREACH(fs::path const& p, g.second)
-                {
-                    paths.insert(get_path(p, f));
-                }
+                if (find_glob_char(detail::path_to_generic(element)) !=
+                        std::string::npos)
+                    break;
+                base /= element;
             }
+            directories.insert(base);
 
-            BOOST_FOREACH(std::string const& p, paths)
+            BOOST_FOREACH(fs::path const& p, g.second)
             {
-                out << p << std::endl;
+                directories.insert(p.parent_path());
             }
         }
+
+        return directories;
+    }
+
+    bool dependency_tracker::affected_by(fs::path const& path) const
+    {
+        BOOST_FOREACH(dependency_list::value_type const& d, dependencies)
+        {
+            if (match_path_prefix(path, d.first, false)) return true;
+        }
+
+        BOOST_FOREACH(glob_list::value_type const& g, glob_dependencies)
+        {
+            if (match_path_prefix(path, g.first, true)) return true;
+        }
+
+        return false;
+    }
+
+    void dependency_tracker::swap(dependency_tracker& other)
+    {
+        dependencies.swap(other.dependencies);
+        glob_dependencies.swap(other.glob_dependencies);
+        last_glob = glob_dependencies.end();
+        other.last_glob = other.glob_dependencies.end();
     }
 }
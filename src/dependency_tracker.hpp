@@ -11,6 +11,7 @@
 
 #include <map>
 #include <set>
+#include <string>
 #include <iosfwd>
 #include <boost/filesystem/path.hpp>
 
@@ -47,6 +48,21 @@ namespace quickbook
 
         void write_dependencies(fs::path const&, flags = default_);
         void write_dependencies(std::ostream&, flags = default_);
+
+        // The files that were found, in the same format as
+        // 'write_dependencies' without the 'checked' flag.
+        std::set<std::string> get_dependencies(flags = default_) const;
+
+        // The directories containing the files that were checked, and the
+        // directories searched by globs. Used for watching for changes.
+        std::set<fs::path> get_directories() const;
+
+        // Could a change to the given path affect the dependencies? That's
+        // true if it was checked, matches a glob, or is a directory that
+        // one of them might be in.
+        bool affected_by(fs::path const&) const;
+
+        void swap(dependency_tracker&);
     };
 }
 
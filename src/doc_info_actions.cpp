@@ -395,10 +395,10 @@ namespace quickbook
             char strdate[64];
             strftime(
                 strdate, sizeof(strdate),
-                (debug_mode ?
+                (state.debug_mode ?
                     "DEBUG MODE Date: %Y/%m/%d %H:%M:%S $" :
                     "$" /* prevent CVS substitution */ "Date: %Y/%m/%d %H:%M:%S $"),
-                current_gm_time
+                &state.current_gm_time
             );
 
             state.out << strdate;
@@ -9,7 +9,6 @@
 #include "document_state_impl.hpp"
 #include "utils.hpp"
 #include <boost/make_shared.hpp>
-#include <boost/lexical_cast.hpp>
 #include <boost/range/algorithm.hpp>
 #include <cctype>
 
@@ -177,14 +176,15 @@ namespace quickbook
     std::string document_state::replace_placeholders_with_unresolved_ids(
             quickbook::string_view xml) const
     {
-        return replace_ids(*state, xml);
+        return replace_ids(xml, find_placeholders(*state, xml));
     }
 
     std::string document_state::replace_placeholders(quickbook::string_view xml) const
     {
         assert(!state->current_file);
-        std::vector<std::string> ids = generate_ids(*state, xml);
-        return replace_ids(*state, xml, &ids);
+        placeholder_locations locations = find_placeholders(*state, xml);
+        std::vector<std::string> ids = generate_ids(*state, locations);
+        return replace_ids(xml, locations, &ids);
     }
 
     unsigned document_state::compatibility_version() const
@@ -203,7 +203,6 @@ namespace quickbook
             id_placeholder const* parent_)
       : index(index_),
         id(id_.begin(), id_.end()),
-        unresolved_id(parent_ ? parent_->unresolved_id + '.' + id : id),
         parent(parent_),
         category(category_),
         num_dots(boost::range::count(id, '.') +
@@ -211,9 +210,54 @@ namespace quickbook
     {
     }
 
+    //
+    // Placeholders are written as 'placeholder_prefix', followed by the
+    // index as 'placeholder_digits' letters from 'A' to 'P', one for each
+    // four bits, most significant first. The prefix is a control character,
+    // which isn't allowed in xml, so it can't clash with an id from the
+    // source, and the fixed width means they can be read without parsing
+    // a number.
+    //
+
+    namespace
+    {
+        char const placeholder_prefix = '\x1a';
+        std::size_t const placeholder_digits = 8;
+    }
+
     std::string id_placeholder::to_string() const
     {
-        return '$' + boost::lexical_cast<std::string>(index);
+        std::string result(placeholder_digits + 1, placeholder_prefix);
+        std::size_t value = index;
+
+        for (std::size_t i = placeholder_digits; i != 0; --i) {
+            result[i] = static_cast<char>('A' + (value & 0xf));
+            value >>= 4;
+        }
+
+        assert(!value);
+        return result;
+    }
+
+    std::string id_placeholder::unresolved_id() const
+    {
+        std::vector<id_placeholder const*> path;
+        std::size_t size = 0;
+
+        for (id_placeholder const* p = this; p; p = p->parent) {
+            path.push_back(p);
+            size += p->id.size() + 1;
+        }
+
+        std::string result;
+        result.reserve(size);
+
+        for (std::size_t i = path.size(); i != 0; --i) {
+            if (i != path.size()) result += '.';
+            result += path[i - 1]->id;
+        }
+
+        return result;
     }
 
     //
@@ -232,11 +276,17 @@ namespace quickbook
     id_placeholder const* document_state_impl::get_placeholder(quickbook::string_view value) const
     {
         // If this isn't a placeholder id.
-        if (value.size() <= 1 || *value.begin() != '$')
+        if (value.size() != placeholder_digits + 1 ||
+                value[0] != placeholder_prefix)
             return 0;
 
-        unsigned index = boost::lexical_cast<unsigned>(std::string(
-                value.begin() + 1, value.end()));
+        std::size_t index = 0;
+
+        for (std::size_t i = 1; i <= placeholder_digits; ++i) {
+            unsigned digit = static_cast<unsigned char>(value[i]) - 'A';
+            if (digit > 0xf) return 0;
+            index = (index << 4) | digit;
+        }
 
         return &placeholders.at(index);
     }
@@ -25,19 +25,15 @@ namespace quickbook
     //
     // When generating the xml, quickbook can't allocate the identifiers until
     // the end, so it stores in the intermedia xml a placeholder string,
-    // e.g. id="$1". This represents one of these placeholders.
+    // created by 'to_string'. This represents one of these placeholders.
     //
 
     struct id_placeholder
     {
         std::size_t index;      // The index in document_state_impl::placeholders.
-                                // Use for the dollar identifiers in
+                                // Used for the placeholder strings in
                                 // intermediate xml.
         std::string id;         // The node id.
-        std::string unresolved_id;
-                                // The id that would be generated
-                                // without any duplicate handling.
-                                // Used for generating old style header anchors.
         id_placeholder const* parent;
                                 // Placeholder of the parent id.
         id_category category;
@@ -50,6 +46,11 @@ namespace quickbook
                 id_category category, id_placeholder const* parent_);
 
         std::string to_string() const;
+
+        // The id that would be generated without any duplicate handling.
+        // Used for generating old style header anchors. Built from the
+        // parents' ids when needed, rather than stored.
+        std::string unresolved_id() const;
     };
 
     //
@@ -113,9 +114,23 @@ namespace quickbook
                 source_mode_info const&);
     };
 
-    std::string replace_ids(document_state_impl const& state, quickbook::string_view xml,
+    // The location of a placeholder in the xml, found by
+    // 'find_placeholders', in the order they appear in the xml.
+    struct placeholder_location
+    {
+        quickbook::string_view value;
+        id_placeholder const* placeholder;
+    };
+
+    typedef std::vector<placeholder_location> placeholder_locations;
+
+    placeholder_locations find_placeholders(document_state_impl const&,
+            quickbook::string_view xml);
+    std::string replace_ids(quickbook::string_view xml,
+            placeholder_locations const&,
             std::vector<std::string> const* = 0);
-    std::vector<std::string> generate_ids(document_state_impl const&, quickbook::string_view);
+    std::vector<std::string> generate_ids(document_state_impl const&,
+            placeholder_locations const&);
 
     std::string normalize_id(quickbook::string_view src_id);
     std::string normalize_id(quickbook::string_view src_id, std::size_t);
@@ -131,10 +146,6 @@ namespace quickbook
 
     struct xml_processor
     {
-        xml_processor();
-
-        std::vector<std::string> id_attributes;
-
         struct callback {
             virtual void start(quickbook::string_view) {}
             virtual void id_value(quickbook::string_view) {}
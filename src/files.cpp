@@ -8,179 +8,590 @@
     http://www.boost.org/LICENSE_1_0.txt)
 =============================================================================*/
 #include "files.hpp"
+#include "simd.hpp"
 #include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/directory.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
 #include <boost/range/algorithm/upper_bound.hpp>
 #include <boost/range/algorithm/transform.hpp>
 #include <boost/foreach.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <ctime>
 #include <fstream>
 #include <iterator>
+#include <list>
 #include <vector>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
 
 namespace quickbook
 {
     namespace
     {
-        boost::unordered_map<fs::path, file_ptr> files;
+        // The normalized contents of the files that have been loaded,
+        // the status of every path that has been checked, and the contents
+        // of every directory that has been searched. These are kept for
+        // the lifetime of the process, so that they can be shared by all
+        // the documents that are processed. They can be accessed from
+        // several threads, so are guarded by 'files_mutex'.
+        //
+        // The file objects aren't cached, as they hold the quickbook
+        // version, which depends on the document that includes them.
+        //
+        // A loaded file is checked against its signature (its size,
+        // modification and change times, and inode) whenever it's used, and
+        // reloaded if it's changed. A file that was modified close to when
+        // it was read could be modified again without changing its
+        // signature, as the times have a limited resolution, so it's
+        // treated as 'racily clean', read again, and compared by its
+        // contents. The least recently used files are dropped when the
+        // total size of the cached files goes over 'file_cache_limit'.
+
+        struct file_signature
+        {
+            boost::uintmax_t size;
+            std::time_t modified;
+            long modified_nsec;
+            std::time_t changed;
+            long changed_nsec;
+            boost::uintmax_t inode;
+
+            bool operator==(file_signature const& x) const
+            {
+                return size == x.size &&
+                    modified == x.modified &&
+                    modified_nsec == x.modified_nsec &&
+                    changed == x.changed &&
+                    changed_nsec == x.changed_nsec &&
+                    inode == x.inode;
+            }
+        };
+
+        struct loaded_file
+        {
+            boost::shared_ptr<void const> storage;
+            quickbook::string_view source;
+            bool mapped;            // Is 'storage' a mapping of the file?
+            file_signature signature;
+            std::time_t read_time;  // When the file was read.
+            std::size_t hash;
+            std::list<fs::path>::iterator lru_position;
+        };
+
+        // The contents of the loaded files, indexed by a hash of their
+        // contents, so that files with the same contents can share their
+        // storage. Doesn't keep the storage alive. Mapped files aren't
+        // included, as their contents change with the file, so mustn't
+        // be used for any other path.
+        struct shared_contents
+        {
+            boost::weak_ptr<void const> storage;
+            quickbook::string_view source;
+        };
+
+        struct directory_listing
+        {
+            std::vector<directory_item> items;
+            std::time_t last_write_time;
+        };
+
+        boost::unordered_map<fs::path, loaded_file> files;
+        boost::unordered_multimap<std::size_t, shared_contents> contents;
+        std::list<fs::path> files_lru; // Most recently used first.
+        boost::uintmax_t files_total_size = 0;
+        boost::uintmax_t file_cache_limit = 256 * 1024 * 1024;
+        bool map_files = true;
+        boost::unordered_map<fs::path, bool> file_status;
+        boost::unordered_map<fs::path, directory_listing> directories;
+        boost::mutex files_mutex;
     }
 
-    // Read the first few bytes in a file to see it starts with a byte order
-    // mark. If it doesn't, then write the characters we've already read in.
-    // Although, given how UTF-8 works, if we've read anything in, the files
-    // probably broken.
+    // Returns false if the file's status couldn't be read.
 
-    template <typename InputIterator, typename OutputIterator>
-    bool check_bom(InputIterator& begin, InputIterator end,
-            OutputIterator out, char const* chars, int length)
+    bool read_signature(fs::path const& filename, file_signature& signature)
     {
-        char const* ptr = chars;
+#if !defined(_WIN32)
+        struct stat status;
+        if (::stat(filename.c_str(), &status) != 0) return false;
+
+        signature.size = static_cast<boost::uintmax_t>(status.st_size);
+#if defined(__APPLE__)
+        signature.modified = status.st_mtimespec.tv_sec;
+        signature.modified_nsec = status.st_mtimespec.tv_nsec;
+        signature.changed = status.st_ctimespec.tv_sec;
+        signature.changed_nsec = status.st_ctimespec.tv_nsec;
+#else
+        signature.modified = status.st_mtim.tv_sec;
+        signature.modified_nsec = status.st_mtim.tv_nsec;
+        signature.changed = status.st_ctim.tv_sec;
+        signature.changed_nsec = status.st_ctim.tv_nsec;
+#endif
+        signature.inode = static_cast<boost::uintmax_t>(status.st_ino);
+        return true;
+#else
+        boost::system::error_code ec1, ec2;
+        signature.modified = fs::last_write_time(filename, ec1);
+        signature.size = fs::file_size(filename, ec2);
+        signature.modified_nsec = 0;
+        signature.changed = signature.modified;
+        signature.changed_nsec = 0;
+        signature.inode = 0;
+        return !ec1 && !ec2;
+#endif
+    }
 
-        while(begin != end && *begin == *ptr) {
-            ++begin;
-            ++ptr;
-            --length;
-            if(length == 0) return true;
-        }
+    // The times are compared to the time the file was read in seconds,
+    // and file system clocks can lag a little, so anything in the
+    // previous second counts as well.
+
+    bool racily_clean(loaded_file const& loaded)
+    {
+        return loaded.signature.modified >= loaded.read_time - 1 ||
+            loaded.signature.changed >= loaded.read_time - 1;
+    }
+
+    // Check if the file starts with a byte order mark, and return its
+    // length. Throws load_error if it isn't UTF-8.
+
+    std::size_t read_bom(quickbook::string_view source)
+    {
+        if (source.starts_with("\xef\xbb\xbf")) return 3;
+
+        char const* encoding =
+            source.starts_with(quickbook::string_view("\0\0\xfe\xff", 4)) ||
+            source.starts_with(quickbook::string_view("\xff\xfe\0\0", 4)) ?
+                "UTF-32" :
+            source.starts_with("\xfe\xff") ||
+            source.starts_with("\xff\xfe") ?
+                "UTF-16" : 0;
+
+        if (encoding)
+            throw load_error(std::string(encoding) +
+                " is not supported. Please use UTF-8.");
 
-        // Failed to match, so write the skipped characters to storage:
-        while(chars != ptr) *out++ = *chars++;
+        return 0;
+    }
+
+    void normalize_newlines(quickbook::string_view source, std::string& out)
+    {
+        out.reserve(out.size() + source.size());
+        char const* begin = source.data();
+        char const* end = begin + source.size();
 
-        return false;
+        // Copy each run of characters up to a carriage return in one go.
+        while(begin != end) {
+            char const* cr = simd::find(begin, end, '\r');
+            out.append(begin, cr);
+            if (cr == end) break;
+
+            out += '\n';
+            begin = cr + 1;
+            if(begin != end && *begin == '\n') ++begin;
+        }
     }
 
-    template <typename InputIterator, typename OutputIterator>
-    std::string read_bom(InputIterator& begin, InputIterator end,
-            OutputIterator out)
+    namespace
     {
-        if(begin == end) return "";
+        // Files at least this big are mapped into memory, smaller files
+        // are just read. The mapping is shared, so a mapped file changes
+        // if it's modified in place, and a file that's truncated while
+        // it's in use will crash the process. That's acceptable when
+        // processing a single document, as it's rare for a build to modify
+        // its own source files, but the long running modes keep files for
+        // much longer, so they call 'set_map_files(false)' to always read
+        // files into memory that they own.
+        boost::uintmax_t const map_threshold = 64 * 1024;
+
+        struct memory_mapped_storage
+        {
+            boost::interprocess::file_mapping mapping;
+            boost::interprocess::mapped_region region;
+        };
+    }
 
-        const char* utf8 = "\xef\xbb\xbf" ;
-        const char* utf32be = "\0\0\xfe\xff";
-        const char* utf32le = "\xff\xfe\0\0";
+    // Sets 'loaded.storage' and 'loaded.source' to the file's raw
+    // contents.
 
-        unsigned char c = *begin;
-        switch(c)
+    void read_file(fs::path const& filename, loaded_file& loaded)
+    {
+        bool map;
         {
-        case 0xEF: { // UTF-8
-            return check_bom(begin, end, out, utf8, 3) ? "UTF-8" : "";
+            boost::lock_guard<boost::mutex> lock(files_mutex);
+            map = map_files;
         }
-        case 0xFF: // UTF-16/UTF-32 little endian
-            return !check_bom(begin, end, out, utf32le, 2) ? "" :
-                check_bom(begin, end, out, utf32le + 2, 2) ? "UTF-32" : "UTF-16";
-        case 0: // UTF-32 big endian
-            return check_bom(begin, end, out, utf32be, 4) ? "UTF-32" : "";
-        case 0xFE: // UTF-16 big endian
-            return check_bom(begin, end, out, utf32be + 2, 2) ? "UTF-16" : "";
-        default:
-            return "";
+
+        if (map && loaded.signature.size >= map_threshold) {
+            try {
+                boost::shared_ptr<memory_mapped_storage> mapped =
+                    boost::make_shared<memory_mapped_storage>();
+                boost::interprocess::file_mapping(
+                    filename.c_str(),
+                    boost::interprocess::read_only).swap(mapped->mapping);
+                boost::interprocess::mapped_region(mapped->mapping,
+                    boost::interprocess::read_only).swap(mapped->region);
+
+                loaded.storage = mapped;
+                loaded.mapped = true;
+                loaded.source = quickbook::string_view(
+                    static_cast<char const*>(mapped->region.get_address()),
+                    mapped->region.get_size());
+                return;
+            }
+            catch (boost::interprocess::interprocess_exception&) {
+                // Fall back to reading the file.
+            }
         }
+
+        fs::ifstream in(filename, std::ios_base::in | std::ios_base::binary);
+
+        if (!in)
+            throw load_error("Could not open input file.");
+
+        boost::shared_ptr<std::string> contents =
+            boost::make_shared<std::string>();
+        contents->reserve(
+            static_cast<std::string::size_type>(loaded.signature.size));
+
+        char buffer[4096];
+        while (in.read(buffer, sizeof(buffer)), in.gcount() > 0)
+            contents->append(buffer, static_cast<std::size_t>(in.gcount()));
+
+        if (in.bad())
+            throw load_error("Error reading input file.");
+
+        loaded.storage = contents;
+        loaded.mapped = false;
+        loaded.source = *contents;
     }
 
-    // Copy a string, converting mac and windows style newlines to unix
-    // newlines.
+    // FNV-1a, reading a word at a time.
+    std::size_t content_hash(quickbook::string_view source)
+    {
+        boost::uint64_t hash = 14695981039346656037ULL;
+        char const* it = source.data();
+        char const* end = it + source.size();
+
+        for (; end - it >= 8; it += 8) {
+            boost::uint64_t word;
+            std::memcpy(&word, it, 8);
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+
+        for (; it != end; ++it) {
+            hash = (hash ^ static_cast<unsigned char>(*it)) * 1099511628211ULL;
+        }
 
-    template <typename InputIterator, typename OutputIterator>
-    void normalize(InputIterator begin, InputIterator end,
-            OutputIterator out)
+        return static_cast<std::size_t>(hash ^ source.size());
+    }
+
+    // These must be called with 'files_mutex' locked.
+
+    // If a file with the same contents has already been loaded, use its
+    // storage. Otherwise, add this file's storage to the index, unless
+    // it's mapped.
+    void share_contents(loaded_file& loaded)
     {
-        std::string encoding = read_bom(begin, end, out);
+        typedef boost::unordered_multimap<std::size_t, shared_contents>
+            contents_map;
+        std::pair<contents_map::iterator, contents_map::iterator> range =
+            contents.equal_range(loaded.hash);
 
-        if(encoding != "UTF-8" && encoding != "")
-        throw load_error(encoding +
-            " is not supported. Please use UTF-8.");
+        for (contents_map::iterator it = range.first; it != range.second;)
+        {
+            boost::shared_ptr<void const> storage = it->second.storage.lock();
 
-        while(begin != end) {
-            if(*begin == '\r') {
-                *out++ = '\n';
-                ++begin;
-                if(begin != end && *begin == '\n') ++begin;
+            if (!storage) {
+                it = contents.erase(it);
+            }
+            else if (it->second.source == loaded.source) {
+                loaded.storage = storage;
+                loaded.mapped = false;
+                loaded.source = it->second.source;
+                return;
             }
             else {
-                *out++ = *begin++;
+                ++it;
             }
         }
+
+        if (!loaded.mapped) {
+            shared_contents c = { loaded.storage, loaded.source };
+            contents.emplace(loaded.hash, c);
+        }
+    }
+
+    void remove_loaded_file(
+        boost::unordered_map<fs::path, loaded_file>::iterator pos)
+    {
+        std::size_t hash = pos->second.hash;
+        files_total_size -= pos->second.source.size();
+        files_lru.erase(pos->second.lru_position);
+        files.erase(pos);
+
+        // Clean up the contents index if that was the last use.
+        typedef boost::unordered_multimap<std::size_t, shared_contents>
+            contents_map;
+        std::pair<contents_map::iterator, contents_map::iterator> range =
+            contents.equal_range(hash);
+
+        for (contents_map::iterator it = range.first; it != range.second;)
+        {
+            if (it->second.storage.expired())
+                it = contents.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void add_loaded_file(fs::path const& filename, loaded_file& loaded)
+    {
+        boost::unordered_map<fs::path, loaded_file>::iterator pos =
+            files.find(filename);
+        if (pos != files.end()) remove_loaded_file(pos);
+
+        share_contents(loaded);
+
+        files_lru.push_front(filename);
+        loaded.lru_position = files_lru.begin();
+        files_total_size += loaded.source.size();
+        files.emplace(filename, loaded);
+
+        // Doesn't remove the file that was just added, even if it's over
+        // the limit on its own.
+        while (files_total_size > file_cache_limit && files_lru.size() > 1) {
+            remove_loaded_file(files.find(files_lru.back()));
+        }
     }
 
     file_ptr load(fs::path const& filename, unsigned qbk_version)
     {
-        boost::unordered_map<fs::path, file_ptr>::iterator pos
-            = files.find(filename);
+        loaded_file loaded;
+        loaded.read_time = std::time(0);
 
-        if (pos == files.end())
+        if (read_signature(filename, loaded.signature))
         {
-            fs::ifstream in(filename, std::ios_base::in);
+            boost::lock_guard<boost::mutex> lock(files_mutex);
 
-            if (!in)
-                throw load_error("Could not open input file.");
+            boost::unordered_map<fs::path, loaded_file>::const_iterator pos
+                = files.find(filename);
 
-            // Turn off white space skipping on the stream
-            in.unsetf(std::ios::skipws);
+            if (pos != files.end() &&
+                    pos->second.signature == loaded.signature &&
+                    !racily_clean(pos->second))
+            {
+                files_lru.splice(files_lru.begin(), files_lru,
+                    pos->second.lru_position);
+                return new file(filename, pos->second.storage,
+                    pos->second.source, qbk_version);
+            }
+        }
 
-            std::string source;
-            normalize(
-                std::istream_iterator<char>(in),
-                std::istream_iterator<char>(),
-                std::back_inserter(source));
+        else
+        {
+            loaded.signature = file_signature();
+        }
 
-            if (in.bad())
-                throw load_error("Error reading input file.");
+        // Read the file without holding the lock, so that other threads
+        // aren't blocked.
+        read_file(filename, loaded);
 
-            bool inserted;
+        // Most files don't need to be changed, so they can be used in
+        // place. Otherwise, copy them with the newlines normalized.
+        loaded.source.remove_prefix(read_bom(loaded.source));
 
-            boost::tie(pos, inserted) = files.emplace(
-                filename, new file(filename, source, qbk_version));
+        char const* source_end = loaded.source.data() + loaded.source.size();
+        if (simd::find(loaded.source.data(), source_end, '\r') != source_end)
+        {
+            boost::shared_ptr<std::string> normalized =
+                boost::make_shared<std::string>();
+            normalize_newlines(loaded.source, *normalized);
+            loaded.storage = normalized;
+            loaded.mapped = false;
+            loaded.source = *normalized;
+        }
+
+        loaded.hash = content_hash(loaded.source);
 
-            assert(inserted);
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+
+        // If the contents haven't changed, keep using the cached copy,
+        // with the new signature.
+        boost::unordered_map<fs::path, loaded_file>::iterator pos =
+            files.find(filename);
+
+        if (pos != files.end() && pos->second.hash == loaded.hash &&
+                pos->second.source == loaded.source)
+        {
+            pos->second.signature = loaded.signature;
+            pos->second.read_time = loaded.read_time;
+            files_lru.splice(files_lru.begin(), files_lru,
+                pos->second.lru_position);
+            return new file(filename, pos->second.storage,
+                pos->second.source, qbk_version);
         }
 
-        return pos->second;
+        add_loaded_file(filename, loaded);
+        return new file(filename, loaded.storage, loaded.source, qbk_version);
     }
 
-    std::ostream& operator<<(std::ostream& out, file_position const& x)
+    void set_file_cache_limit(boost::uintmax_t bytes)
     {
-        return out << "line: " << x.line << ", column: " << x.column;
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+        file_cache_limit = bytes;
     }
 
-    file_position relative_position(
-        string_iterator begin,
-        string_iterator iterator)
+    void set_map_files(bool map)
     {
-        file_position pos;
-        string_iterator line_begin = begin;
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+        map_files = map;
+    }
 
-        while (begin != iterator)
+    bool file_exists(fs::path const& filename)
+    {
         {
-            if (*begin == '\r')
-            {
-                ++begin;
-                ++pos.line;
-                line_begin = begin;
-            }
-            else if (*begin == '\n')
-            {
-                ++begin;
-                ++pos.line;
-                line_begin = begin;
-                if (begin == iterator) break;
-                if (*begin == '\r')
-                {
-                    ++begin;
-                    line_begin = begin;
-                }
+            boost::lock_guard<boost::mutex> lock(files_mutex);
+
+            boost::unordered_map<fs::path, bool>::const_iterator pos
+                = file_status.find(filename);
+
+            if (pos != file_status.end()) return pos->second;
+        }
+
+        bool found = fs::exists(fs::status(filename));
+
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+        file_status.emplace(filename, found);
+        return found;
+    }
+
+    bool list_directory(fs::path const& dirname,
+            std::vector<directory_item>& items)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(files_mutex);
+
+            boost::unordered_map<fs::path, directory_listing>::const_iterator
+                pos = directories.find(dirname);
+
+            if (pos != directories.end()) {
+                items = pos->second.items;
+                return true;
             }
+        }
+
+        if (!fs::is_directory(dirname)) return false;
+
+        directory_listing listing;
+        boost::system::error_code ec;
+        listing.last_write_time = fs::last_write_time(dirname, ec);
+
+        for (fs::directory_iterator dir_i(dirname), dir_e;
+                dir_i != dir_e; ++dir_i)
+        {
+            directory_item item;
+            item.filename = dir_i->path().filename();
+            item.is_regular_file = fs::is_regular_file(dir_i->status());
+            listing.items.push_back(item);
+        }
+
+        items = listing.items;
+
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+        directories.emplace(dirname, listing);
+        return true;
+    }
+
+    void forget_file(fs::path const& filename)
+    {
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+
+        boost::unordered_map<fs::path, loaded_file>::iterator pos =
+            files.find(filename);
+        if (pos != files.end()) remove_loaded_file(pos);
+
+        file_status.erase(filename);
+        directories.erase(filename);
+    }
+
+    void check_cached_files()
+    {
+        boost::lock_guard<boost::mutex> lock(files_mutex);
+
+        // Checking a path's status costs as much as looking it up again.
+        // Loaded files are checked when they're used.
+        file_status.clear();
+
+        for (boost::unordered_map<fs::path, directory_listing>::iterator
+                it = directories.begin(); it != directories.end();)
+        {
+            boost::system::error_code ec;
+            std::time_t last_write_time = fs::last_write_time(it->first, ec);
+
+            if (ec || last_write_time != it->second.last_write_time)
+                it = directories.erase(it);
             else
-            {
-                ++begin;
-            }
+                ++it;
         }
+    }
 
-        pos.column = iterator - line_begin + 1;
-        return pos;
+    std::ostream& operator<<(std::ostream& out, file_position const& x)
+    {
+        return out << "line: " << x.line << ", column: " << x.column;
     }
 
     file_position file::position_of(string_iterator iterator) const
     {
-        return relative_position(source().begin(), iterator);
+        quickbook::string_view const src = source();
+
+        // A line starts after a '\r' or a '\n', but a '\r' directly after
+        // a '\n' is part of the same line break.
+        if (!line_starts_built_)
+        {
+            for (std::string::size_type i = 0; i < src.size();)
+            {
+                char c = src[i++];
+
+                if (c == '\n') {
+                    line_starts_.push_back(i);
+                    if (i < src.size() && src[i] == '\r') ++i;
+                }
+                else if (c == '\r') {
+                    line_starts_.push_back(i);
+                }
+            }
+
+            line_starts_built_ = true;
+        }
+
+        std::string::size_type offset = iterator - src.begin();
+
+        std::vector<std::string::size_type>::const_iterator line =
+            std::upper_bound(line_starts_.begin(), line_starts_.end(), offset);
+
+        std::string::size_type line_begin = 0;
+
+        if (line != line_starts_.begin())
+        {
+            line_begin = *(line - 1);
+
+            // Skip a '\r' after a '\n', unless the position is on it.
+            if (offset > line_begin && src[line_begin] == '\r' &&
+                    src[line_begin - 1] == '\n')
+                ++line_begin;
+        }
+
+        return file_position(line - line_starts_.begin() + 1,
+            offset - line_begin + 1);
     }
 
     // Mapped files.
@@ -250,12 +661,39 @@ namespace quickbook
     struct mapped_file : file
     {
         explicit mapped_file(file_ptr original_) :
-            file(*original_, std::string()),
-            original(original_), mapped_sections()
+            file(*original_, quickbook::string_view()),
+            original(original_), mapped_sections(), indented_lines(),
+            buffer()
         {}
 
         file_ptr original;
         std::vector<mapped_file_section> mapped_sections;
+
+        // The start of every line in the indented sections, and the start
+        // of the corresponding line in the original source.
+        std::vector<mapped_file_section> indented_lines;
+
+        // Holds the source, as it's built up a piece at a time.
+        std::string buffer;
+
+        template <typename Iterator>
+        void append(Iterator begin, Iterator end)
+        {
+            buffer.append(begin, end);
+            source_ = buffer;
+        }
+
+        void append(std::string::size_type n, char c)
+        {
+            buffer.append(n, c);
+            source_ = buffer;
+        }
+
+        void reserve(std::string::size_type n)
+        {
+            buffer.reserve(buffer.size() + n);
+            source_ = buffer;
+        }
         
         void add_empty_mapped_file_section(string_iterator pos) {
             std::string::size_type original_pos =
@@ -296,31 +734,18 @@ namespace quickbook
                     return section->original_pos;
 
                 case mapped_file_section::indented: {
-                    // Will contain the start of the current line.
-                    quickbook::string_view::size_type our_line = section->our_pos;
-
-                    // Will contain the number of lines in the block before
-                    // the current line.
-                    unsigned newline_count = 0;
-
-                    for(quickbook::string_view::size_type i = section->our_pos;
-                        i != pos; ++i)
-                    {
-                        if (source()[i] == '\n') {
-                            our_line = i + 1;
-                            ++newline_count;
-                        }
-                    }
+                    std::vector<mapped_file_section>::const_iterator line =
+                        boost::upper_bound(indented_lines, pos,
+                            mapped_section_pos_cmp());
+                    assert(line != indented_lines.begin());
+                    --line;
+
+                    // The start of the current line.
+                    quickbook::string_view::size_type our_line = line->our_pos;
 
                     // The start of the line in the original source.
                     quickbook::string_view::size_type original_line =
-                        section->original_pos;
-                    
-                    while(newline_count > 0) {
-                        if (original->source()[original_line] == '\n')
-                            --newline_count;
-                        ++original_line;
-                    }
+                        line->original_pos;
 
                     // The start of line content (i.e. after indentation).
                     our_line = skip_indentation(source(), our_line);
@@ -376,12 +801,28 @@ namespace quickbook
         std::list<mapped_file> mapped_files;
     }
 
+    // A line in a block of code that's being unindented.
+    struct unindent_line
+    {
+        // The start of the newlines before the line.
+        std::string::size_type newlines;
+        // The start of the line, and the end of its indentation.
+        std::string::size_type start, indent_end;
+        // The width of the indentation, with tabs expanded.
+        std::string::size_type width;
+        // How many characters of the indentation match the first line.
+        std::string::size_type common;
+    };
+
     struct mapped_file_builder_data
     {
         mapped_file_builder_data() { reset(); }
         void reset() { new_file.reset(); }
     
         boost::intrusive_ptr<mapped_file> new_file;
+
+        // Reused by 'unindent_and_add' to avoid allocating every time.
+        std::vector<unindent_line> lines;
     };
 
     mapped_file_builder::mapped_file_builder() : data(0) {}
@@ -422,26 +863,26 @@ namespace quickbook
     void mapped_file_builder::add_at_pos(quickbook::string_view x, iterator pos)
     {
         data->new_file->add_empty_mapped_file_section(pos);
-        data->new_file->source_.append(x.begin(), x.end());
+        data->new_file->append(x.begin(), x.end());
     }
 
     void mapped_file_builder::add(quickbook::string_view x)
     {
         data->new_file->add_mapped_file_section(x.begin());
-        data->new_file->source_.append(x.begin(), x.end());
+        data->new_file->append(x.begin(), x.end());
     }
 
     void mapped_file_builder::add(mapped_file_builder const& x)
     {
-        add(x, 0, x.data->new_file->source_.size());
+        add(x, 0, x.data->new_file->source().size());
     }
 
     void mapped_file_builder::add(mapped_file_builder const& x,
             pos_type begin, pos_type end)
     {
         assert(data->new_file->original == x.data->new_file->original);
-        assert(begin <= x.data->new_file->source_.size());
-        assert(end <= x.data->new_file->source_.size());
+        assert(begin <= x.data->new_file->source().size());
+        assert(end <= x.data->new_file->source().size());
 
         if (begin != end)
         {
@@ -449,11 +890,28 @@ namespace quickbook
                 x.data->new_file->find_section(
                     x.data->new_file->source().begin() + begin);
     
-            std::string::size_type size = data->new_file->source_.size();
+            std::string::size_type size = data->new_file->source().size();
     
             data->new_file->mapped_sections.push_back(mapped_file_section(
                     x.data->new_file->to_original_pos(i, begin),
                     size, i->section_type));
+
+            if (i->section_type == mapped_file_section::indented)
+            {
+                data->new_file->indented_lines.push_back(
+                    data->new_file->mapped_sections.back());
+            }
+
+            for (std::vector<mapped_file_section>::const_iterator
+                    line = boost::upper_bound(x.data->new_file->indented_lines,
+                        begin, mapped_section_pos_cmp());
+                    line != x.data->new_file->indented_lines.end() &&
+                        line->our_pos < end; ++line)
+            {
+                data->new_file->indented_lines.push_back(mapped_file_section(
+                    line->original_pos, line->our_pos - begin + size,
+                    mapped_file_section::indented));
+            }
     
             for (++i; i != x.data->new_file->mapped_sections.end() &&
                     i->our_pos < end; ++i)
@@ -463,136 +921,164 @@ namespace quickbook
                     i->section_type));
             }
     
-            data->new_file->source_.append(
-                x.data->new_file->source_.begin() + begin,
-            x.data->new_file->source_.begin() + end);
+            data->new_file->append(
+                x.data->new_file->source().begin() + begin,
+                x.data->new_file->source().begin() + end);
         }
     }
 
-    quickbook::string_view::size_type indentation_count(quickbook::string_view x)
+    static bool is_newline(char c)
     {
-        unsigned count = 0;
-
-        for(string_iterator begin = x.begin(), end = x.end();
-            begin != end; ++begin)
-        {
-            switch(*begin)
-            {
-            case ' ':
-                ++count;
-                break;
-            case '\t':
-                // hardcoded tab to 4 for now
-                count = count - (count % 4) + 4;
-                break;
-            default:
-                assert(false);
-            }
-        }
-
-        return count;
+        return c == '\r' || c == '\n';
     }
 
     void mapped_file_builder::unindent_and_add(quickbook::string_view x)
     {
-        // I wanted to do everything using a string_ref, but unfortunately
-        // they don't have all the overloads used in here. So...
-        std::string const program(x.begin(), x.end());
+        char const* const program = x.data();
+        std::string::size_type const size = x.size();
 
         // Erase leading blank lines and newlines:
-        std::string::size_type text_start = program.find_first_not_of(" \t\r\n");
-        if (text_start == std::string::npos) return;
+        std::string::size_type text_start = x.find_first_not_of(" \t\r\n");
+        if (text_start == quickbook::string_view::npos) return;
 
-        text_start = program.find_last_of("\r\n", text_start);
-        text_start = text_start == std::string::npos ? 0 : text_start + 1;
+        text_start = x.find_last_of("\r\n", text_start);
+        text_start = text_start == quickbook::string_view::npos ?
+            0 : text_start + 1;
 
-        assert(text_start < program.size());
+        assert(text_start < size);
 
-        // Get the first line indentation
-        std::string::size_type indent = program.find_first_not_of(" \t", text_start) - text_start;
-        quickbook::string_view::size_type full_indent = indentation_count(
-            quickbook::string_view(&program[text_start], indent));
+        // Find the lines, and measure their indentation in a single pass.
+        std::vector<unindent_line>& lines = data->lines;
+        lines.clear();
 
         std::string::size_type pos = text_start;
+        std::string::size_type newlines = text_start;
+        std::string::size_type trailing_newlines = size;
 
-        // Calculate the minimum indent from the rest of the lines
-        // Detecting a mix of spaces and tabs.
-        while (std::string::npos != (pos = program.find_first_of("\r\n", pos)))
+        for (;;)
         {
-            pos = program.find_first_not_of("\r\n", pos);
-            if (std::string::npos == pos) break;
+            unindent_line line = { newlines, pos, pos, 0, 0 };
+            unindent_line const* first = lines.empty() ? 0 : &lines.front();
+            bool common = !!first;
 
-            std::string::size_type n = program.find_first_not_of(" \t", pos);
-            if (n == std::string::npos) break;
+            for (; pos != size && (program[pos] == ' ' || program[pos] == '\t');
+                    ++pos)
+            {
+                if (program[pos] == ' ')
+                    ++line.width;
+                else
+                    // hardcoded tab to 4 for now
+                    line.width = line.width - (line.width % 4) + 4;
+
+                if (common &&
+                        line.common < first->indent_end - first->start &&
+                        program[first->start + line.common] == program[pos])
+                    ++line.common;
+                else
+                    common = false;
+            }
+
+            line.indent_end = pos;
+            lines.push_back(line);
 
-            char ch = program[n];
-            if (ch == '\r' || ch == '\n') continue; // ignore empty lines
+            while (pos != size && !is_newline(program[pos])) ++pos;
+            if (pos == size) break;
 
-            indent = (std::min)(indent, n-pos);
-            full_indent = (std::min)(full_indent, indentation_count(
-                quickbook::string_view(&program[pos], n-pos)));
+            newlines = pos;
+            while (pos != size && is_newline(program[pos])) ++pos;
+
+            if (pos == size) {
+                trailing_newlines = newlines;
+                break;
+            }
         }
 
-        // Detect if indentation is mixed.
-        bool mixed_indentation = false;
-        quickbook::string_view first_indent(&program[text_start], indent);
-        pos = text_start;
+        // Calculate the minimum indent from the first line, and the rest
+        // of the lines that aren't blank. Then check if the indentation is
+        // mixed, i.e. if any line's indentation doesn't start with the
+        // first line's indentation.
+        std::string::size_type indent =
+            lines.front().indent_end - lines.front().start;
+        std::string::size_type full_indent = lines.front().width;
 
-        while (std::string::npos != (pos = program.find_first_of("\r\n", pos)))
+        for (std::vector<unindent_line>::const_iterator
+                it = lines.begin() + 1; it != lines.end(); ++it)
         {
-            pos = program.find_first_not_of("\r\n", pos);
-            if (std::string::npos == pos) break;
+            if (it->indent_end == size || is_newline(program[it->indent_end]))
+                continue;
+
+            indent = (std::min)(indent, it->indent_end - it->start);
+            full_indent = (std::min)(full_indent, it->width);
+        }
 
-            std::string::size_type n = program.find_first_not_of(" \t", pos);
-            if (n == std::string::npos || n-pos < indent) continue;
+        bool mixed_indentation = false;
 
-            if (quickbook::string_view(&program[pos], indent) != first_indent) {
+        for (std::vector<unindent_line>::const_iterator
+                it = lines.begin() + 1; it != lines.end(); ++it)
+        {
+            if (it->indent_end != size &&
+                    it->indent_end - it->start >= indent &&
+                    it->common < indent)
+            {
                 mixed_indentation = true;
                 break;
             }
         }
 
-        // Trim white spaces from column 0..indent
-        std::string unindented_program;
-        std::string::size_type copy_start = text_start;
-        pos = text_start;
+        // Trim white spaces from column 0..indent, writing directly into
+        // the new file. Also record where each line starts, so that
+        // positions can be mapped back to the original without rescanning
+        // the lines. Newlines are copied as they are, so only the lines'
+        // indentation changes.
+        mapped_file& f = *data->new_file;
+        std::string::size_type const original_base =
+            x.begin() - f.original->source().begin();
+
+        f.add_indented_mapped_file_section(x.begin());
+        f.reserve(size - text_start);
+        f.indented_lines.push_back(mapped_file_section(
+            original_base + text_start, f.source().size(),
+            mapped_file_section::indented));
 
-        do {
-            if (std::string::npos == (pos = program.find_first_not_of("\r\n", pos)))
-                break;
+        std::string::size_type copy_start = text_start;
 
-            unindented_program.append(program.begin() + copy_start, program.begin() + pos);
-            copy_start = pos;
+        for (std::vector<unindent_line>::const_iterator it = lines.begin();
+                it != lines.end(); ++it)
+        {
+            for (pos = it->newlines; pos != it->start; ++pos) {
+                if (program[pos] == '\n') {
+                    f.indented_lines.push_back(mapped_file_section(
+                        original_base + pos + 1,
+                        f.source().size() + pos + 1 - copy_start,
+                        mapped_file_section::indented));
+                }
+            }
 
-            // Find the end of the indentation.
-            std::string::size_type next = program.find_first_not_of(" \t", pos);
-            if (next == std::string::npos) next = program.size();
+            f.append(program + copy_start, program + it->start);
 
             if (mixed_indentation)
             {
-                string_view::size_type length = indentation_count(quickbook::string_view(
-                    &program[pos], next - pos));
+                if (it->width > full_indent)
+                    f.append(it->width - full_indent, ' ');
 
-                if (length > full_indent) {
-                    std::string new_indentation(length - full_indent, ' ');
-                    unindented_program.append(new_indentation);
-                }
-
-                copy_start = next;
+                copy_start = it->indent_end;
             }
             else
             {
-                copy_start = (std::min)(pos + indent, next);
+                copy_start = (std::min)(it->start + indent, it->indent_end);
             }
+        }
 
-            pos = next;
-        } while (std::string::npos !=
-            (pos = program.find_first_of("\r\n", pos)));
-
-        unindented_program.append(program.begin() + copy_start, program.end());
+        for (pos = trailing_newlines; pos != size; ++pos) {
+            if (program[pos] == '\n') {
+                f.indented_lines.push_back(mapped_file_section(
+                    original_base + pos + 1,
+                    f.source().size() + pos + 1 - copy_start,
+                    mapped_file_section::indented));
+            }
+        }
 
-        data->new_file->add_indented_mapped_file_section(x.begin());
-        data->new_file->source_.append(unindented_program);
+        f.append(program + copy_start, program + size);
     }
 
     file_position mapped_file::position_of(string_iterator pos) const
@@ -12,8 +12,12 @@
 #define BOOST_QUICKBOOK_FILES_HPP
 
 #include <string>
+#include <vector>
 #include <boost/filesystem/path.hpp>
 #include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/cstdint.hpp>
 #include "string_view.hpp"
 #include <stdexcept>
 #include <cassert>
@@ -50,28 +54,61 @@ namespace quickbook {
         file(file const&);
     public:
         fs::path const path;
-        std::string source_;
+    protected:
+        // 'storage_' owns the memory that 'source_' points to. It can be
+        // shared with other file objects, e.g. by the file cache, and can
+        // be a mapped file, so there's no null terminator.
+        boost::shared_ptr<void const> storage_;
+        quickbook::string_view source_;
+    public:
         bool is_code_snippets;
     private:
         unsigned qbk_version;
         unsigned ref_count;
+
+        // The offset of the start of every line after the first, built the
+        // first time that 'position_of' is called.
+        mutable std::vector<std::string::size_type> line_starts_;
+        mutable bool line_starts_built_;
     public:
         quickbook::string_view source() const { return source_; }
 
         file(fs::path const& path_, quickbook::string_view source_view,
                 unsigned qbk_version_) :
             path(path_),
-            source_(source_view.begin(), source_view.end()),
+            storage_(),
+            source_(),
+            is_code_snippets(false),
+            qbk_version(qbk_version_),
+            ref_count(0),
+            line_starts_(),
+            line_starts_built_(false)
+        {
+            copy_source(source_view);
+        }
+
+        file(fs::path const& path_,
+                boost::shared_ptr<void const> const& storage,
+                quickbook::string_view source_view,
+                unsigned qbk_version_) :
+            path(path_),
+            storage_(storage),
+            source_(source_view),
             is_code_snippets(false),
             qbk_version(qbk_version_),
-            ref_count(0)
+            ref_count(0),
+            line_starts_(),
+            line_starts_built_(false)
         {}
 
         explicit file(file const& f, quickbook::string_view s) :
-            path(f.path), source_(s.begin(), s.end()),
+            path(f.path), storage_(), source_(),
             is_code_snippets(f.is_code_snippets),
-            qbk_version(f.qbk_version), ref_count(0)
-        {}
+            qbk_version(f.qbk_version), ref_count(0),
+            line_starts_(), line_starts_built_(false)
+        {
+            copy_source(s);
+        }
 
         virtual ~file() {
             assert(!ref_count);
@@ -92,6 +129,16 @@ namespace quickbook {
 
         virtual file_position position_of(string_iterator) const;
 
+    private:
+        void copy_source(quickbook::string_view s)
+        {
+            boost::shared_ptr<std::string> copy =
+                boost::make_shared<std::string>(s.begin(), s.end());
+            storage_ = copy;
+            source_ = *copy;
+        }
+
+    public:
         friend void intrusive_ptr_add_ref(file* ptr) { ++ptr->ref_count; }
 
         friend void intrusive_ptr_release(file* ptr)
@@ -99,9 +146,51 @@ namespace quickbook {
     };
 
     // If version isn't supplied then it must be set later.
+    //
+    // The file's contents are cached, so each file is only read again if
+    // its size, modification or change time, or inode have changed, or if
+    // it was modified shortly before it was read, but a new file object
+    // is returned for every call. Files with the same contents share the
+    // same storage, unless they're mapped into memory.
     file_ptr load(fs::path const& filename,
         unsigned qbk_version = 0);
 
+    // Set the maximum size of the file cache, the least recently used
+    // files are removed when it's exceeded.
+    void set_file_cache_limit(boost::uintmax_t bytes);
+
+    // Set whether large files can be mapped into memory, rather than
+    // read. A mapped file's contents change if it's modified in place, so
+    // this should be turned off by processes which keep files for a long
+    // time. On by default.
+    void set_map_files(bool map);
+
+    // Append 'source' to 'out', converting mac and windows style newlines
+    // to unix newlines.
+    void normalize_newlines(quickbook::string_view source, std::string& out);
+
+    // Check if a file exists, the result is cached.
+    bool file_exists(fs::path const& filename);
+
+    struct directory_item
+    {
+        fs::path filename;
+        bool is_regular_file;
+    };
+
+    // List the contents of a directory, returns false if it isn't a
+    // directory. The result is cached.
+    bool list_directory(fs::path const& dirname,
+        std::vector<directory_item>& items);
+
+    // Remove a path from the caches, call this if it might have changed.
+    void forget_file(fs::path const& filename);
+
+    // Remove any cached directory listings which have been modified
+    // since they were read, and forget every file's status. For use by
+    // long running processes, before processing a document.
+    void check_cached_files();
+
     struct load_error : std::runtime_error
     {
         explicit load_error(std::string const& arg)
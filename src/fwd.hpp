@@ -12,6 +12,18 @@
 #define BOOST_SPIRIT_FWD_HPP
 
 #include <boost/intrusive_ptr.hpp>
+#include <boost/config.hpp>
+
+// For data that's local to the document being processed, so that several
+// documents can be processed in parallel.
+
+#if !defined(BOOST_NO_CXX11_THREAD_LOCAL)
+#   define QUICKBOOK_THREAD_LOCAL thread_local
+#elif defined(BOOST_MSVC)
+#   define QUICKBOOK_THREAD_LOCAL __declspec(thread)
+#else
+#   define QUICKBOOK_THREAD_LOCAL __thread
+#endif
 
 namespace quickbook
 {
@@ -27,19 +27,21 @@ namespace quickbook {
     static const std::size_t max_size = 32;
 
     typedef std::vector<id_placeholder const*> placeholder_index;
-    placeholder_index index_placeholders(document_state_impl const&, quickbook::string_view);
+    placeholder_index index_placeholders(document_state_impl const&,
+            placeholder_locations const&);
 
     void generate_id_block(
             placeholder_index::iterator, placeholder_index::iterator,
             std::vector<std::string>& generated_ids);
 
-    std::vector<std::string> generate_ids(document_state_impl const& state, quickbook::string_view xml)
+    std::vector<std::string> generate_ids(document_state_impl const& state,
+            placeholder_locations const& locations)
     {
         std::vector<std::string> generated_ids(state.placeholders.size());
 
         // Get a list of the placeholders in the order that we wish to
         // process them.
-        placeholder_index placeholders = index_placeholders(state, xml);
+        placeholder_index placeholders = index_placeholders(state, locations);
 
         typedef std::vector<id_placeholder const*>::iterator iterator;
         iterator it = placeholders.begin(), end = placeholders.end();
@@ -89,24 +91,16 @@ namespace quickbook {
         }
     };
 
-    struct get_placeholder_order_callback : xml_processor::callback
+    struct placeholder_order
     {
-        document_state_impl const& state;
         std::vector<unsigned>& order;
         unsigned count;
 
-        get_placeholder_order_callback(document_state_impl const& state_,
-                std::vector<unsigned>& order_)
-          : state(state_),
-            order(order_),
+        explicit placeholder_order(std::vector<unsigned>& order_)
+          : order(order_),
             count(0)
         {}
 
-        void id_value(quickbook::string_view value)
-        {
-            set_placeholder_order(state.get_placeholder(value));
-        }
-
         void set_placeholder_order(id_placeholder const* p)
         {
             if (p && !order[p->index]) {
@@ -118,14 +112,14 @@ namespace quickbook {
 
     placeholder_index index_placeholders(
             document_state_impl const& state,
-            quickbook::string_view xml)
+            placeholder_locations const& locations)
     {
         // The order that the placeholder appear in the xml source.
         std::vector<unsigned> order(state.placeholders.size());
 
-        xml_processor processor;
-        get_placeholder_order_callback callback(state, order);
-        processor.parse(xml, callback);
+        placeholder_order ordering(order);
+        BOOST_FOREACH(placeholder_location const& location, locations)
+            ordering.set_placeholder_order(location.placeholder);
 
         placeholder_index sorted_placeholders;
         sorted_placeholders.reserve(state.placeholders.size());
@@ -146,6 +140,17 @@ namespace quickbook {
         chosen_id_map chosen_ids;
         std::vector<std::string>& generated_ids;
 
+        // Where to resume numbering duplicates of an id. Ids are never
+        // released, so every postfix before this one is already taken.
+        struct next_postfix
+        {
+            std::string::size_type length;
+            unsigned count;
+        };
+        typedef boost::unordered_map<std::string, next_postfix>
+            next_postfix_map;
+        next_postfix_map next_postfixes;
+
         explicit generate_id_block_type(std::vector<std::string>& generated_ids_) :
             generated_ids(generated_ids_) {}
 
@@ -241,7 +246,20 @@ namespace quickbook {
             }
         }
 
-        unsigned count = 0;
+        // Resume from where the last duplicate of this id stopped.
+        std::pair<next_postfix_map::iterator, bool> next =
+            next_postfixes.emplace(parent_id + base_id, next_postfix());
+
+        if (next.second) {
+            next.first->second.length = length;
+            next.first->second.count = 0;
+        }
+        else {
+            length = next.first->second.length;
+            base_id.erase(length);
+        }
+
+        unsigned count = next.first->second.count;
 
         while (true)
         {
@@ -270,6 +288,8 @@ namespace quickbook {
                 std::string generated_id = parent_id + base_id + postfix;
 
                 if (chosen_ids.emplace(generated_id, p).second) {
+                    next.first->second.length = length;
+                    next.first->second.count = count;
                     return generated_id;
                 }
             }
@@ -277,59 +297,92 @@ namespace quickbook {
     }
 
     //
-    // replace_ids
+    // find_placeholders
     //
-    // Return a copy of the xml with all the placeholders replaced by
-    // generated_ids.
+    // Find the placeholders in the id attributes of the xml, so that
+    // the xml only has to be parsed once.
     //
 
-    struct replace_ids_callback : xml_processor::callback
+    struct find_placeholders_callback : xml_processor::callback
     {
         document_state_impl const& state;
-        std::vector<std::string> const* ids;
-        string_iterator source_pos;
-        std::string result;
+        placeholder_locations& locations;
 
-        replace_ids_callback(document_state_impl const& state_,
-                std::vector<std::string> const* ids_)
+        find_placeholders_callback(document_state_impl const& state_,
+                placeholder_locations& locations_)
           : state(state_),
-            ids(ids_),
-            source_pos(),
-            result()
+            locations(locations_)
         {}
 
-        void start(quickbook::string_view xml)
-        {
-            source_pos = xml.begin();
-        }
-
         void id_value(quickbook::string_view value)
         {
             if (id_placeholder const* p = state.get_placeholder(value))
             {
-                quickbook::string_view id = ids ?
-                    (*ids)[p->index] : p->unresolved_id;
-
-                result.append(source_pos, value.begin());
-                result.append(id.begin(), id.end());
-                source_pos = value.end();
+                placeholder_location location = { value, p };
+                locations.push_back(location);
             }
         }
-
-        void finish(quickbook::string_view xml)
-        {
-            result.append(source_pos, xml.end());
-            source_pos = xml.end();
-        }
     };
 
-    std::string replace_ids(document_state_impl const& state, quickbook::string_view xml,
-            std::vector<std::string> const* ids)
+    placeholder_locations find_placeholders(
+            document_state_impl const& state,
+            quickbook::string_view xml)
     {
+        placeholder_locations locations;
         xml_processor processor;
-        replace_ids_callback callback(state, ids);
+        find_placeholders_callback callback(state, locations);
         processor.parse(xml, callback);
-        return callback.result;
+        return locations;
+    }
+
+    //
+    // replace_ids
+    //
+    // Return a copy of the xml with all the placeholders replaced by
+    // generated_ids, or their unresolved ids if 'ids' is null.
+    //
+
+    std::string replace_ids(quickbook::string_view xml,
+            placeholder_locations const& locations,
+            std::vector<std::string> const* ids)
+    {
+        // The unresolved ids aren't stored, so build them for each
+        // location. This is only used for small pieces of xml, such as
+        // heading titles.
+        std::vector<std::string> unresolved_ids;
+        if (!ids) {
+            unresolved_ids.reserve(locations.size());
+            BOOST_FOREACH(placeholder_location const& location, locations)
+                unresolved_ids.push_back(location.placeholder->unresolved_id());
+        }
+
+        std::size_t size = xml.size();
+        std::size_t index = 0;
+        BOOST_FOREACH(placeholder_location const& location, locations)
+        {
+            size = size - location.value.size() + (ids ?
+                (*ids)[location.placeholder->index] :
+                unresolved_ids[index++]).size();
+        }
+
+        std::string result;
+        result.reserve(size);
+        string_iterator source_pos = xml.begin();
+        index = 0;
+
+        BOOST_FOREACH(placeholder_location const& location, locations)
+        {
+            std::string const& id = ids ?
+                (*ids)[location.placeholder->index] :
+                unresolved_ids[index++];
+
+            result.append(source_pos, location.value.begin());
+            result.append(id.begin(), id.end());
+            source_pos = location.value.end();
+        }
+
+        result.append(source_pos, xml.end());
+        return result;
     }
 
     //
@@ -8,30 +8,30 @@
 
 #include "document_state_impl.hpp"
 #include "utils.hpp"
-#include <boost/range/algorithm.hpp>
+#include "simd.hpp"
+#include <cstring>
 
 namespace quickbook
 {
     namespace
     {
-        char const* id_attributes_[] =
+        // The attributes which can contain ids: "id", "linkend",
+        // "linkends" and "arearefs". Checked without allocating, as this
+        // is called for every attribute in the document.
+        bool is_id_attribute(quickbook::string_view name)
         {
-            "id",
-            "linkend",
-            "linkends",
-            "arearefs"
-        };
-    }
-
-    xml_processor::xml_processor()
-    {
-        static std::size_t const n_id_attributes = sizeof(id_attributes_)/sizeof(char const*);
-        for (int i = 0; i != n_id_attributes; ++i)
-        {
-            id_attributes.push_back(id_attributes_[i]);
+            switch (name.size()) {
+            case 2:
+                return name[0] == 'i' && name[1] == 'd';
+            case 7:
+                return std::memcmp(name.data(), "linkend", 7) == 0;
+            case 8:
+                return std::memcmp(name.data(), "linkends", 8) == 0 ||
+                    std::memcmp(name.data(), "arearefs", 8) == 0;
+            default:
+                return false;
+            }
         }
-
-        boost::sort(id_attributes);
     }
 
     template <typename Iterator>
@@ -48,10 +48,16 @@ namespace quickbook
         }
     }
 
-    template <typename Iterator>
-    void read_past(Iterator& it, Iterator end, char const* text)
+    // Skips to the first occurrence of the first character of 'text',
+    // using 'simd::find', and then checks the rest.
+    inline void read_past(string_iterator& it, string_iterator end,
+            char const* text)
     {
-        while (it != end && !read(it, end, text)) ++it;
+        for (;;) {
+            it = simd::find(it, end, *text);
+            if (it == end || read(it, end, text)) return;
+            ++it;
+        }
     }
 
     bool find_char(char const* text, char c)
@@ -129,13 +135,12 @@ namespace quickbook
 
                         iterator value_start = it;
 
-                        it = std::find(it, end, delim);
+                        it = simd::find(it, end, delim);
                         if (it == end) break;
                         quickbook::string_view value(value_start, it - value_start);
                         ++it;
 
-                        if (boost::find(id_attributes, name.to_s())
-                                != id_attributes.end())
+                        if (is_id_attribute(name))
                         {
                             c.id_value(value);
                         }
@@ -196,7 +201,7 @@ namespace quickbook
                             if (*it == '"' || *it == '\'') {
                                 char delim = *it;
                                 ++it;
-                                it = std::find(it, end, delim);
+                                it = simd::find(it, end, delim);
                                 if (it == end) break;
                                 ++it;
                             }
@@ -15,7 +15,7 @@
 #include "path.hpp"
 #include "state.hpp"
 #include "utils.hpp"
-#include "quickbook.hpp" // For the include_path global (yuck)
+#include "files.hpp"
 #include <boost/foreach.hpp>
 #include <boost/range/algorithm/replace.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -160,14 +160,13 @@ namespace quickbook
 
         fs::path base_dir = new_location.file_path.empty() ?
             fs::path(".") : new_location.file_path;
-        if (!fs::is_directory(base_dir)) return;
+        std::vector<directory_item> items;
+        if (!list_directory(base_dir, items)) return;
 
         // Walk through the dir for matches.
-        for (fs::directory_iterator dir_i(base_dir), dir_e;
-                dir_i != dir_e; ++dir_i)
+        BOOST_FOREACH(directory_item const& item, items)
         {
-            fs::path f = dir_i->path().filename();
-            std::string generic_path = detail::path_to_generic(f);
+            std::string generic_path = detail::path_to_generic(item.filename);
 
             // Skip if the dir item doesn't match.
             if (!quickbook::glob(glob, generic_path)) continue;
@@ -175,7 +174,7 @@ namespace quickbook
             // If it's a file we add it to the results.
             if (next == std::string::npos)
             {
-                if (fs::is_regular_file(dir_i->status()))
+                if (item.is_regular_file)
                 {
                     quickbook_path r = new_location / generic_path;
                     state.dependencies.add_glob_match(r.file_path);
@@ -185,7 +184,7 @@ namespace quickbook
             // If it's a matching dir, we recurse looking for more files.
             else
             {
-                if (!fs::is_regular_file(dir_i->status()))
+                if (!item.is_regular_file)
                 {
                     include_search_glob(result, new_location / generic_path,
                             path.substr(next), state);
@@ -213,7 +212,7 @@ namespace quickbook
 
                 // Search the include path dirs accumulating to the result.
                 unsigned count = 0;
-                BOOST_FOREACH(fs::path dir, include_path)
+                BOOST_FOREACH(fs::path dir, state.include_path)
                 {
                     ++count;
                     state.dependencies.add_glob(dir / parameter.value);
@@ -245,7 +244,7 @@ namespace quickbook
 
                     // Search in each of the include path locations.
                     unsigned count = 0;
-                    BOOST_FOREACH(fs::path full, include_path)
+                    BOOST_FOREACH(fs::path full, state.include_path)
                     {
                         ++count;
                         full /= path;
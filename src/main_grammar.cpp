@@ -265,6 +265,61 @@ namespace quickbook
         }
     };
 
+    // Matches a run of characters which can't start any markup, so that
+    // plain text can be written out in one go, rather than a character
+    // at a time. Stops before whitespace, since several of the phrase
+    // terminators start with it, and before anything that might be a
+    // macro. Doesn't match anything if the first character might be
+    // markup, leaving it for the rest of 'common'.
+
+    struct plain_text_parser : public cl::parser<plain_text_parser>
+    {
+        typedef plain_text_parser self_t;
+
+        template <typename Scanner>
+        struct result
+        {
+            typedef cl::match<> type;
+        };
+
+        explicit plain_text_parser(string_symbols const& macros_)
+            : macros(macros_) {}
+
+        template <typename Scanner>
+        typename result<Scanner>::type parse(Scanner const& scan) const
+        {
+            typedef typename Scanner::iterator_t iterator_t;
+
+            iterator_t save(scan.first);
+
+            while (!scan.at_end() && is_plain(*scan.first)) {
+                iterator_t pos(scan.first);
+                bool is_macro = macros.find(scan);
+                scan.first = pos;
+                if (is_macro) break;
+                ++scan.first;
+            }
+
+            return scan.first == save ? scan.no_match() :
+                scan.create_match(scan.first.base() - save.base(),
+                    cl::nil_t(), save, scan.first);
+        }
+
+        static bool is_plain(char c)
+        {
+            switch (c) {
+            case '[': case ']': case '`': case '\\': case '\'':
+            case '*': case '/': case '_': case '=':
+            case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+                return false;
+            default:
+                return true;
+            }
+        }
+
+        string_symbols const& macros;
+    };
+
     template <typename T, typename M>
     struct set_scoped_value_impl : scoped_action_base
     {
@@ -313,6 +368,7 @@ namespace quickbook
         phrase_end_action end_phrase(state);
         raw_char_action raw_char(state);
         plain_char_action plain_char(state);
+        plain_text_parser plain_text(state.macro);
         escape_unicode_action escape_unicode(state);
 
         simple_phrase_action simple_markup(state);
@@ -601,7 +657,8 @@ namespace quickbook
             ;
 
         local.common =
-                local.macro
+                plain_text                  [plain_char]
+            |   local.macro
             |   local.element
             |   local.template_
             |   local.break_
@@ -66,9 +66,14 @@ namespace quickbook
             }
         }
 
+        // This doesn't modify 'markups', so that it can be called from
+        // several threads.
         markup const& get_markup(value::tag_type t)
         {
-            return markups[t];
+            static markup const no_markup = { 0, 0, 0 };
+            std::map<value::tag_type, markup>::const_iterator pos =
+                markups.find(t);
+            return pos == markups.end() ? no_markup : pos->second;
         }
 
         std::ostream& operator<<(std::ostream& out, markup const& m)
@@ -7,16 +7,78 @@
     http://www.boost.org/LICENSE_1_0.txt)
 =============================================================================*/
 #include "post_process.hpp"
-#include <boost/spirit/include/classic_core.hpp>
+#include "string_view.hpp"
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/bind.hpp>
-#include <set>
-#include <stack>
-#include <cctype>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <algorithm>
+#include <vector>
+#include <ostream>
+#include <cstring>
 
 namespace quickbook
 {
-    namespace cl = boost::spirit::classic;
-    typedef std::string::const_iterator iter_type;
+    typedef char const* iter_type;
+
+    namespace
+    {
+        // The same as 'std::isspace' in the "C" locale.
+        inline bool is_space(char ch)
+        {
+            switch (ch) {
+            case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        inline bool is_tag_char(char ch)
+        {
+            return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+                ch == '_' || ch == ':';
+        }
+
+        inline iter_type skip_space(iter_type f, iter_type l)
+        {
+            while (f != l && is_space(*f)) ++f;
+            return f;
+        }
+
+        inline iter_type trim_space(iter_type f, iter_type l)
+        {
+            while (l != f && is_space(*(l-1))) --l;
+            return l;
+        }
+
+        inline iter_type skip_tag_name(iter_type f, iter_type l)
+        {
+            while (f != l && is_tag_char(*f)) ++f;
+            return f;
+        }
+
+        template <std::size_t N>
+        bool starts_with(iter_type f, iter_type l, char const (&s)[N])
+        {
+            return static_cast<std::size_t>(l - f) >= N - 1 &&
+                std::memcmp(f, s, N - 1) == 0;
+        }
+
+        template <std::size_t N>
+        iter_type find_string(iter_type f, iter_type l, char const (&s)[N])
+        {
+            return std::search(f, l, s, s + N - 1);
+        }
+
+        char const escape_prefix[] = "<!--quickbook-escape-prefix-->";
+        char const escape_postfix[] = "<!--quickbook-escape-postfix-->";
+        char const code_start[] = "<programlisting>";
+        char const code_end[] = "</programlisting>";
+    }
 
     struct printer
     {
@@ -27,8 +89,7 @@ namespace quickbook
         void indent()
         {
             BOOST_ASSERT(current_indent >= 0); // this should not happen!
-            for (int i = 0; i < current_indent; ++i)
-                out += ' ';
+            if (current_indent > 0) out.append(current_indent, ' ');
             column = current_indent;
         }
 
@@ -46,7 +107,8 @@ namespace quickbook
 
         bool line_is_empty() const
         {
-            for (iter_type i = out.end()-(column-current_indent); i != out.end(); ++i)
+            for (std::string::const_iterator i = out.end()-(column-current_indent);
+                    i != out.end(); ++i)
             {
                 if (*i != ' ')
                     return false;
@@ -76,18 +138,16 @@ namespace quickbook
                 else
                 {
                     // will this happen? (i.e. column <= current_indent)
-                    while (column != current_indent)
-                    {
-                        out += ' ';
-                        ++column;
-                    }
+                    out.append(current_indent - column, ' ');
+                    column = current_indent;
                 }
             }
         }
 
-        void print(char ch)
+        void
+        print(iter_type f, iter_type l)
         {
-            // Print a char. Attempt to break the line if we are exceeding
+            // Print some text. Attempt to break the line if we are exceeding
             // the target linewidth. The linewidth is not an absolute limit.
             // There are many cases where a line will exceed the linewidth
             // and there is no way to properly break the line. Preformatted
@@ -97,55 +157,82 @@ namespace quickbook
             // output (i.e. processing two logically equivalent xml files
             // results in two lexically equivalent xml files). *** pretty
             // formatting is a secondary goal ***
+            //
+            // Text that can't affect the line breaking is copied a run at
+            // a time.
 
-            // Strings will occur only in tag attributes. Normal content
-            // will have &quot; instead. We shall deal only with tag
-            // attributes here.
-            if (ch == '"')
-                in_string = !in_string; // don't break strings!
-
-            if (!in_string && std::isspace(static_cast<unsigned char>(ch)))
+            while (f != l)
             {
-                // we can break spaces if they are not inside strings
-                if (!std::isspace(static_cast<unsigned char>(prev)))
+                // Strings will occur only in tag attributes. Normal content
+                // will have &quot; instead. We shall deal only with tag
+                // attributes here. Don't break strings!
+                if (in_string)
                 {
-                    if (column >= linewidth)
+                    iter_type end = std::find(f, l, '"');
+                    if (end == f) {
+                        in_string = false;
+                        append(f, f + 1);
+                        ++f;
+                    }
+                    else {
+                        append(f, end);
+                        f = end;
+                    }
+                }
+                else if (is_space(*f))
+                {
+                    // we can break spaces if they are not inside strings,
+                    // consecutive spaces are collapsed into one
+                    char ch = *f;
+                    iter_type end = skip_space(f, l);
+
+                    if (!is_space(prev))
                     {
-                        break_line();
-                        if (column == 0 && ch == ' ')
+                        if (column >= linewidth)
+                        {
+                            break_line();
+                            if (column == 0 && ch == ' ')
+                            {
+                                ++column;
+                                out += ' ';
+                            }
+                        }
+                        else
                         {
                             ++column;
                             out += ' ';
                         }
                     }
-                    else
-                    {
-                        ++column;
-                        out += ' ';
-                    }
+
+                    prev = *(end - 1);
+                    f = end;
+                }
+                else if (*f == '"')
+                {
+                    in_string = true;
+                    append(f, f + 1);
+                    ++f;
+                }
+                else if (*f == '<')
+                {
+                    // we can break tag boundaries and stuff after
+                    // delimiters if they are not inside strings
+                    // and *only-if* the preceding char is a space
+                    if (column >= linewidth && is_space(prev))
+                        break_line();
+                    append(f, f + 1);
+                    ++f;
+                }
+                else
+                {
+                    iter_type end = f + 1;
+                    while (end != l && *end != '"' && *end != '<' &&
+                            !is_space(*end))
+                        ++end;
+                    append(f, end);
+                    f = end;
                 }
             }
-            else
-            {
-                // we can break tag boundaries and stuff after
-                // delimiters if they are not inside strings
-                // and *only-if* the preceding char is a space
-                if (!in_string
-                    && column >= linewidth
-                    && (ch == '<' && std::isspace(static_cast<unsigned char>(prev))))
-                    break_line();
-                out += ch;
-                ++column;
-            }
-
-            prev = ch;
-        }
-
-        void
-        print(iter_type f, iter_type l)
-        {
-            for (iter_type i = f; i != l; ++i)
-                print(*i);
         }
 
         void
@@ -160,12 +247,8 @@ namespace quickbook
                 // This is not a flow tag, so, we're going to do a
                 // carriage return anyway. Let us remove extra right
                 // spaces.
-                std::string str(f, l);
                 BOOST_ASSERT(f != l); // this should not happen
-                iter_type i = str.end();
-                while (i != str.begin() && std::isspace(static_cast<unsigned char>(*(i-1))))
-                    --i;
-                print(str.begin(), i);
+                print(f, trim_space(f, l));
             }
         }
 
@@ -175,6 +258,16 @@ namespace quickbook
         int column;
         bool in_string;
         int linewidth;
+
+    private:
+        // Write text which doesn't contain any spaces or quotes outside
+        // of a string.
+        void append(iter_type f, iter_type l)
+        {
+            out.append(f, l);
+            column += static_cast<int>(l - f);
+            prev = *(l - 1);
+        }
     };
 
     char const* block_tags_[] =
@@ -226,231 +319,645 @@ namespace quickbook
         , "set"
     };
 
-    struct tidy_compiler
+    // A perfect hash table of the block tags. The multiplier was chosen so
+    // that none of the tags collide, which is checked when the table is
+    // built, so a lookup only has to compare a single name.
+    struct block_tag_table
     {
-        tidy_compiler(std::string& out_, int linewidth_)
-            : out(out_), current_indent(0), printer_(out, current_indent, linewidth_)
+        static unsigned const size = 256;
+
+        block_tag_table()
         {
             static std::size_t const n_block_tags = sizeof(block_tags_)/sizeof(char const*);
             for (std::size_t i = 0; i != n_block_tags; ++i)
             {
-                block_tags.insert(block_tags_[i]);
+                insert(block_tags_[i]);
             }
 
             static std::size_t const n_doc_types = sizeof(doc_types_)/sizeof(char const*);
             for (std::size_t i = 0; i != n_doc_types; ++i)
             {
-                block_tags.insert(doc_types_[i]);
-                block_tags.insert(doc_types_[i] + std::string("info"));
-                block_tags.insert(doc_types_[i] + std::string("purpose"));
+                insert(doc_types_[i]);
+                insert(doc_types_[i] + std::string("info"));
+                insert(doc_types_[i] + std::string("purpose"));
             }
         }
 
-        bool is_flow_tag(std::string const& tag)
+        static unsigned hash(quickbook::string_view name)
         {
-            return block_tags.find(tag) == block_tags.end();
+            boost::uint32_t h = 0;
+            for (quickbook::string_view::const_iterator i = name.begin();
+                    i != name.end(); ++i)
+            {
+                h = (h + static_cast<unsigned char>(*i)) * 159489u;
+            }
+            return static_cast<unsigned>(h >> 24);
         }
 
-        std::set<std::string> block_tags;
-        std::stack<std::string> tags;
-        std::string& out;
-        int current_indent;
-        printer printer_;
-        std::string current_tag;
+        void insert(std::string const& name)
+        {
+            std::string& entry = tags[hash(name)];
+            BOOST_ASSERT(entry.empty());
+            entry = name;
+        }
+
+        bool contains(quickbook::string_view name) const
+        {
+            return !name.empty() && name == tags[hash(name)];
+        }
+
+        std::string tags[size];
     };
 
-    struct tidy_grammar : cl::grammar<tidy_grammar>
+    // Built during static initialization, rather than on first use, as
+    // it's shared by the pretty printing threads.
+    block_tag_table const block_tags;
+
+    // A place where the document can be split, so that the parts can be
+    // processed separately. This is just after a block tag, where the
+    // printer has started a new line, and isn't in a string, so the state
+    // of the printer only depends on the indentation. The other state
+    // needed to continue from here is stored.
+    struct split_point
     {
-        tidy_grammar(tidy_compiler& state_, int indent_)
-            : state(state_), indent(indent_) {}
+        iter_type position;
+        int indent;
+        std::vector<quickbook::string_view> tags;
+        quickbook::string_view current_tag;
+    };
 
-        template <typename Scanner>
-        struct definition
+    struct tidy_compiler
+    {
+        // If 'sink_' isn't null, output is written to it as the document is
+        // processed, and only the end of the output is kept in 'out_'.
+        tidy_compiler(std::string& out_, std::ostream* sink_,
+                int indent_, int linewidth_)
+            : out(out_), sink(sink_), indent(indent_), current_indent(0)
+            , printer_(out, current_indent, linewidth_)
+            , splits(0), split_size(0), quotes(0), can_split(true)
+        {}
+
+        // Scan the document for places to split it, without generating
+        // any output. A split is added after at least 'size' bytes
+        // since the last one.
+        void find_splits(std::vector<split_point>& splits_,
+                std::size_t size)
         {
-            definition(tidy_grammar const& self)
-            {
-                tag = (cl::lexeme_d[+(cl::alpha_p | '_' | ':')])  [boost::bind(&tidy_grammar::do_tag, &self, _1, _2)];
-
-                code =
-                        "<programlisting>"
-                    >>  *(cl::anychar_p - "</programlisting>")
-                    >>  "</programlisting>"
-                    ;
-
-                // What's the business of cl::lexeme_d['>' >> *cl::space_p]; ?
-                // It is there to preserve the space after the tag that is
-                // otherwise consumed by the cl::space_p skipper.
-
-                escape =
-                    cl::str_p("<!--quickbook-escape-prefix-->") >>
-                    (*(cl::anychar_p - cl::str_p("<!--quickbook-escape-postfix-->")))
-                    [
-                        boost::bind(&tidy_grammar::do_escape, &self, _1, _2)
-                    ]
-                    >>  cl::lexeme_d
-                        [
-                            cl::str_p("<!--quickbook-escape-postfix-->") >>
-                            (*cl::space_p)
-                            [
-                                boost::bind(&tidy_grammar::do_escape_post, &self, _1, _2)
-                            ]
-                        ]
-                    ;
-
-                start_tag = '<' >> tag >> *(cl::anychar_p - '>') >> cl::lexeme_d['>' >> *cl::space_p];
-                start_end_tag =
-                        '<' >> tag >> *(cl::anychar_p - ("/>" | cl::ch_p('>'))) >> cl::lexeme_d["/>" >> *cl::space_p]
-                    |   "<?" >> tag >> *(cl::anychar_p - '?') >> cl::lexeme_d["?>" >> *cl::space_p]
-                    |   "<!--" >> *(cl::anychar_p - "-->") >> cl::lexeme_d["-->" >> *cl::space_p]
-                    |   "<!" >> tag >> *(cl::anychar_p - '>') >> cl::lexeme_d['>' >> *cl::space_p]
-                    ;
-                content = cl::lexeme_d[ +(cl::anychar_p - '<') ];
-                end_tag = "</" >> +(cl::anychar_p - '>') >> cl::lexeme_d['>' >> *cl::space_p];
-
-                markup =
-                        escape
-                    |   code            [boost::bind(&tidy_grammar::do_code, &self, _1, _2)]
-                    |   start_end_tag   [boost::bind(&tidy_grammar::do_start_end_tag, &self, _1, _2)]
-                    |   start_tag       [boost::bind(&tidy_grammar::do_start_tag, &self, _1, _2)]
-                    |   end_tag         [boost::bind(&tidy_grammar::do_end_tag, &self, _1, _2)]
-                    |   content         [boost::bind(&tidy_grammar::do_content, &self, _1, _2)]
-                    ;
-
-                tidy = +markup;
-            }
-
-            cl::rule<Scanner> const&
-            start() { return tidy; }
-
-            cl::rule<Scanner>
-                            tidy, tag, start_tag, start_end_tag,
-                            content, end_tag, markup, code, escape;
-        };
+            splits = &splits_;
+            split_size = size;
+        }
 
-        void do_escape_post(iter_type f, iter_type l) const
+        // Continue from a split point, assumes that the output so far is
+        // the start of a new line.
+        void start_from(split_point const& start)
         {
-            for (iter_type i = f; i != l; ++i)
-                state.out += *i;
+            out += '\n';
+            current_indent = start.indent;
+            printer_.indent();
+            tags = start.tags;
+            current_tag = start.current_tag;
         }
 
-        void do_escape(iter_type f, iter_type l) const
+        bool is_flow_tag(quickbook::string_view tag)
         {
-            while (f != l && std::isspace(*f))
-                ++f;
-            for (iter_type i = f; i != l; ++i)
-                state.out += *i;
+            return !block_tags.contains(tag);
         }
 
-        void do_code(iter_type f, iter_type l) const
+        // Process the whole document, throws post_process_failure if it
+        // can't be parsed. Whitespace between pieces of markup is dropped,
+        // but most markup consumes the whitespace that follows it, and
+        // it's an error for anything else to be left at the end.
+        void process(iter_type f, iter_type l)
         {
-            state.printer_.trim_spaces();
-            if (state.out[state.out.size() - 1] != '\n')
-                state.out += '\n';
-            // print the string taking care of line
-            // ending CR/LF platform issues
-            for (iter_type i = f; i != l; ++i)
+            bool matched = false;
+
+            for (;;)
+            {
+                iter_type next = skip_space(f, l);
+                if (next == l || !process_markup(next, l)) break;
+                f = next;
+                matched = true;
+                if (sink && out.size() >= flush_size) flush();
+            }
+
+            if (!matched || f != l)
             {
-                if (*i == '\n')
+                throw quickbook::post_process_failure("Post Processing Failed.");
+            }
+        }
+
+        // Write out the start of the output, keeping the text that the
+        // printer might still change. It can trim trailing spaces, and
+        // look back up to 'column' characters for the start of the line.
+        void flush()
+        {
+            std::string::size_type keep = out.find_last_not_of(' ');
+            if (keep == std::string::npos) return;
+
+            std::string::size_type column = printer_.column > 0 ?
+                static_cast<std::string::size_type>(printer_.column) : 0;
+            if (column < out.size())
+                keep = (std::min)(keep, out.size() - column);
+            else
+                keep = 0;
+
+            if (keep) {
+                sink->write(out.data(), keep);
+                out.erase(0, keep);
+            }
+        }
+
+        // Process a single piece of markup starting at 'f', and advance
+        // 'f' past it, along with any following whitespace that belongs
+        // to it. Returns false if there's no valid markup at 'f'.
+        //
+        // The alternatives are tried in the same order as the grammar this
+        // replaced, including its side effects on failure, so that the
+        // output is the same, even for odd documents: an unterminated
+        // escape is still written out, and 'current_tag' is set by every
+        // tag name that's found, so a comment is formatted the same as
+        // the last tag that was seen.
+        bool process_markup(iter_type& f, iter_type l)
+        {
+            if (starts_with(f, l, escape_prefix))
+            {
+                iter_type body = skip_space(f + sizeof(escape_prefix) - 1, l);
+                iter_type end = find_string(body, l, escape_postfix);
+                do_escape(body, trim_space(body, end));
+
+                if (end != l)
                 {
-                    state.printer_.trim_spaces();
-                    state.out += '\n';
-                    ++i;
-                    if (i != l && *i != '\r')
-                        state.out += *i;
+                    iter_type post = end + sizeof(escape_postfix) - 1;
+                    f = skip_space(post, l);
+                    do_escape_post(post, f);
+                    return true;
                 }
-                else if (*i == '\r')
+
+                // The rest of the document was written out, so it can't
+                // be split.
+                can_split = false;
+            }
+
+            if (starts_with(f, l, code_start))
+            {
+                iter_type end = find_string(
+                    f + sizeof(code_start) - 1, l, code_end);
+
+                if (end != l)
                 {
-                    state.printer_.trim_spaces();
-                    state.out += '\n';
-                    ++i;
-                    if (i != l && *i != '\n')
-                        state.out += *i;
+                    end += sizeof(code_end) - 1;
+                    do_code(f, end);
+                    f = end;
+                    return true;
                 }
-                else
+            }
+
+            if (*f != '<') {
+                iter_type end = std::find(f, l, '<');
+                do_content(f, end);
+                f = end;
+                return true;
+            }
+
+            // Start tag or empty element tag.
+            iter_type name = skip_space(f + 1, l);
+            iter_type name_end = skip_tag_name(name, l);
+            iter_type tag_end = l;
+
+            if (name != name_end)
+            {
+                current_tag = tag_name(name, name_end);
+                tag_end = std::find(name_end, l, '>');
+
+                if (tag_end != l && *(tag_end - 1) == '/')
+                    return start_end_tag(f, tag_end + 1, l);
+            }
+
+            // Processing instruction.
+            if (starts_with(f, l, "<?"))
+            {
+                iter_type pi_name = skip_space(f + 2, l);
+                iter_type pi_name_end = skip_tag_name(pi_name, l);
+
+                if (pi_name != pi_name_end)
+                {
+                    current_tag = tag_name(pi_name, pi_name_end);
+                    iter_type end = std::find(pi_name_end, l, '?');
+                    if (end != l && end + 1 != l && *(end + 1) == '>')
+                        return start_end_tag(f, end + 2, l);
+                }
+            }
+
+            // Comment.
+            if (starts_with(f, l, "<!--"))
+            {
+                iter_type end = find_string(f + 4, l, "-->");
+                if (end != l)
+                    return start_end_tag(f, end + 3, l);
+            }
+
+            // Declaration, e.g. "<!DOCTYPE ...>"
+            if (starts_with(f, l, "<!"))
+            {
+                iter_type decl_name = skip_space(f + 2, l);
+                iter_type decl_name_end = skip_tag_name(decl_name, l);
+
+                if (decl_name != decl_name_end)
+                {
+                    current_tag = tag_name(decl_name, decl_name_end);
+                    iter_type end = std::find(decl_name_end, l, '>');
+                    if (end != l)
+                        return start_end_tag(f, end + 1, l);
+                }
+            }
+
+            if (tag_end != l)
+            {
+                iter_type end = skip_space(tag_end + 1, l);
+                do_start_tag(f, end);
+                f = end;
+                return true;
+            }
+
+            // End tag, which can have anything but an empty name.
+            if (starts_with(f, l, "</"))
+            {
+                iter_type end_name = skip_space(f + 2, l);
+
+                if (end_name != l && *end_name != '>')
                 {
-                    state.out += *i;
+                    iter_type end = std::find(end_name, l, '>');
+                    if (end != l)
+                    {
+                        end = skip_space(end + 1, l);
+                        do_end_tag(f, end);
+                        f = end;
+                        return true;
+                    }
                 }
             }
-            state.out += '\n';
-            state.printer_.indent();
+
+            return false;
+        }
+
+        bool start_end_tag(iter_type& f, iter_type end, iter_type l)
+        {
+            end = skip_space(end, l);
+            do_start_end_tag(f, end);
+            f = end;
+            return true;
+        }
+
+        static quickbook::string_view tag_name(iter_type f, iter_type l)
+        {
+            return quickbook::string_view(f, l - f);
+        }
+
+        // Called instead of printing when looking for split points. The
+        // quotes in the printed text are counted to track whether the
+        // printer is in a string.
+        void scanned(iter_type f, iter_type l, bool is_flow_tag)
+        {
+            quotes += std::count(f, l, '"');
+
+            if (!is_flow_tag && quotes % 2 == 0 &&
+                    static_cast<std::size_t>(l - splits->back().position) >=
+                        split_size)
+            {
+                splits->push_back(split_point());
+                split_point& split = splits->back();
+                split.position = l;
+                split.indent = current_indent;
+                split.tags = tags;
+                split.current_tag = current_tag;
+            }
+        }
+
+        void do_escape_post(iter_type f, iter_type l)
+        {
+            if (splits) return;
+            out.append(f, l);
         }
 
-        void do_tag(iter_type f, iter_type l) const
+        void do_escape(iter_type f, iter_type l)
         {
-            state.current_tag = std::string(f, l);
+            if (splits) return;
+            out.append(f, l);
+        }
+
+        void do_code(iter_type f, iter_type l)
+        {
+            if (splits) return;
+
+            printer_.trim_spaces();
+            if (out.empty() || out[out.size() - 1] != '\n')
+                out += '\n';
+            // print the string taking care of line
+            // ending CR/LF platform issues
+            while (f != l)
+            {
+                iter_type end = f;
+                while (end != l && *end != '\n' && *end != '\r') ++end;
+                out.append(f, end);
+                if (end == l) break;
+
+                char ch = *end;
+                printer_.trim_spaces();
+                out += '\n';
+                f = end + 1;
+                if (f != l)
+                {
+                    if (*f != (ch == '\n' ? '\r' : '\n'))
+                        out += *f;
+                    ++f;
+                }
+            }
+            out += '\n';
+            printer_.indent();
         }
 
-        void do_start_end_tag(iter_type f, iter_type l) const
+        void do_start_end_tag(iter_type f, iter_type l)
         {
-            bool is_flow_tag = state.is_flow_tag(state.current_tag);
+            bool is_flow_tag = this->is_flow_tag(current_tag);
+            if (splits)
+            {
+                scanned(f, l, is_flow_tag);
+                return;
+            }
             if (!is_flow_tag)
-                state.printer_.align_indent();
-            state.printer_.print_tag(f, l, is_flow_tag);
+                printer_.align_indent();
+            printer_.print_tag(f, l, is_flow_tag);
             if (!is_flow_tag)
-                state.printer_.break_line();
+                printer_.break_line();
         }
 
-        void do_start_tag(iter_type f, iter_type l) const
+        void do_start_tag(iter_type f, iter_type l)
         {
-            state.tags.push(state.current_tag);
-            bool is_flow_tag = state.is_flow_tag(state.current_tag);
+            tags.push_back(current_tag);
+            bool is_flow_tag = this->is_flow_tag(current_tag);
+            if (splits)
+            {
+                if (!is_flow_tag)
+                    current_indent += indent;
+                scanned(f, l, is_flow_tag);
+                return;
+            }
             if (!is_flow_tag)
-                state.printer_.align_indent();
-            state.printer_.print_tag(f, l, is_flow_tag);
+                printer_.align_indent();
+            printer_.print_tag(f, l, is_flow_tag);
             if (!is_flow_tag)
             {
-                state.current_indent += indent;
-                state.printer_.break_line();
+                current_indent += indent;
+                printer_.break_line();
             }
         }
 
-        void do_content(iter_type f, iter_type l) const
+        void do_content(iter_type f, iter_type l)
         {
-            state.printer_.print(f, l);
+            if (splits)
+                quotes += std::count(f, l, '"');
+            else
+                printer_.print(f, l);
         }
 
-        void do_end_tag(iter_type f, iter_type l) const
+        void do_end_tag(iter_type f, iter_type l)
         {
-            if (state.tags.empty())
+            if (tags.empty())
                 throw quickbook::post_process_failure("Mismatched tags.");
-        
-            bool is_flow_tag = state.is_flow_tag(state.tags.top());
+
+            bool is_flow_tag = this->is_flow_tag(tags.back());
+            tags.pop_back();
+            if (splits)
+            {
+                if (!is_flow_tag)
+                    current_indent -= indent;
+                scanned(f, l, is_flow_tag);
+                return;
+            }
             if (!is_flow_tag)
             {
-                state.current_indent -= indent;
-                state.printer_.align_indent();
+                current_indent -= indent;
+                printer_.align_indent();
             }
-            state.printer_.print_tag(f, l, is_flow_tag);
+            printer_.print_tag(f, l, is_flow_tag);
             if (!is_flow_tag)
-                state.printer_.break_line();
-            state.tags.pop();
+                printer_.break_line();
         }
 
-        tidy_compiler& state;
+        // The amount of output to collect before writing it to 'sink'.
+        static std::string::size_type const flush_size = 64 * 1024;
+
+        std::vector<quickbook::string_view> tags;
+        std::string& out;
+        std::ostream* sink;
         int indent;
+        int current_indent;
+        printer printer_;
+        quickbook::string_view current_tag;
+
+        // Used when finding split points.
+        std::vector<split_point>* splits;
+        std::size_t split_size;
+        std::size_t quotes;
+        bool can_split;
     };
 
+    namespace
+    {
+        void set_defaults(int& indent, int& linewidth)
+        {
+            if (indent == -1)
+                indent = 2;         // set default to 2
+            if (linewidth == -1)
+                linewidth = 80;     // set default to 80
+        }
+    }
+
     std::string post_process(
         std::string const& in
       , int indent
       , int linewidth)
     {
-        if (indent == -1)
-            indent = 2;         // set default to 2
-        if (linewidth == -1)
-            linewidth = 80;     // set default to 80
+        set_defaults(indent, linewidth);
 
         std::string tidy;
-        tidy_compiler state(tidy, linewidth);
-        tidy_grammar g(state, indent);
-        cl::parse_info<iter_type> r = parse(in.begin(), in.end(), g, cl::space_p);
-        if (r.full)
+        tidy_compiler state(tidy, 0, indent, linewidth);
+        state.process(in.data(), in.data() + in.size());
+        return tidy;
+    }
+
+    namespace
+    {
+        // The smallest part of a document to process in a thread.
+        std::size_t const min_split_size = 64 * 1024;
+
+        // Processes the parts of a split document in several threads,
+        // while the parts are written out in order.
+        struct parallel_post_process
         {
-            return tidy;
+            parallel_post_process(std::vector<split_point> const& splits_,
+                    iter_type last_, int indent_, int linewidth_,
+                    std::size_t window_)
+                : splits(splits_), last(last_)
+                , indent(indent_), linewidth(linewidth_)
+                , results(splits_.size()), done(splits_.size(), false)
+                , next(0), written(0), window(window_), failed(false)
+                , mutex(), changed()
+            {}
+
+            void process_part(std::size_t index, std::string& result)
+            {
+                tidy_compiler state(result, 0, indent, linewidth);
+                if (index) state.start_from(splits[index]);
+                state.process(splits[index].position,
+                    index + 1 < splits.size() ?
+                        splits[index + 1].position : last);
+            }
+
+            void run()
+            {
+                for (;;)
+                {
+                    std::size_t index;
+
+                    {
+                        // Don't get too far ahead of the output.
+                        boost::unique_lock<boost::mutex> lock(mutex);
+                        while (next < splits.size() && next >= written + window)
+                            changed.wait(lock);
+                        if (next == splits.size()) return;
+                        index = next++;
+                    }
+
+                    std::string result;
+                    bool success = true;
+
+                    try {
+                        process_part(index, result);
+                    }
+                    catch (std::exception&) {
+                        success = false;
+                    }
+
+                    {
+                        boost::lock_guard<boost::mutex> lock(mutex);
+                        results[index].swap(result);
+                        done[index] = true;
+                        if (!success) failed = true;
+                    }
+
+                    changed.notify_all();
+                }
+            }
+
+            // Write out the parts as they're finished. Each part, apart
+            // from the first, starts with the newline that finished the
+            // previous part, and every part, apart from the last, ends
+            // with the indentation for the next one.
+            bool write(std::ostream& out)
+            {
+                for (std::size_t index = 0; index < splits.size(); ++index)
+                {
+                    std::string result;
+
+                    {
+                        boost::unique_lock<boost::mutex> lock(mutex);
+                        while (!done[index] && !failed)
+                            changed.wait(lock);
+
+                        if (failed) {
+                            next = splits.size();
+                            changed.notify_all();
+                            return false;
+                        }
+
+                        results[index].swap(result);
+                        written = index + 1;
+                    }
+
+                    changed.notify_all();
+
+                    std::size_t start = index ? 1 : 0;
+                    std::size_t end = result.size() -
+                        (index + 1 < splits.size() ?
+                            static_cast<std::size_t>(splits[index + 1].indent) : 0);
+                    BOOST_ASSERT(start <= end);
+                    out.write(result.data() + start, end - start);
+                }
+
+                return true;
+            }
+
+            std::vector<split_point> const& splits;
+            iter_type last;
+            int indent;
+            int linewidth;
+            std::vector<std::string> results;
+            std::vector<bool> done;
+            std::size_t next;
+            std::size_t written;
+            std::size_t window;
+            bool failed;
+            boost::mutex mutex;
+            boost::condition_variable changed;
+        };
+    }
+
+    void post_process(
+        std::string const& in
+      , std::ostream& out
+      , int indent
+      , int linewidth
+      , unsigned threads)
+    {
+        set_defaults(indent, linewidth);
+
+        iter_type first = in.data();
+        iter_type last = first + in.size();
+        std::vector<split_point> splits;
+
+        if (threads > 1 && in.size() >= 2 * min_split_size)
+        {
+            // Split the document into several parts for each thread,
+            // so that the work is shared out evenly. This also checks
+            // that the document can be processed, so nothing is written
+            // if it can't.
+            std::string unused;
+            tidy_compiler scan(unused, 0, indent, linewidth);
+            splits.push_back(split_point());
+            splits.back().position = first;
+            splits.back().indent = 0;
+            scan.find_splits(splits,
+                (std::max)(in.size() / (threads * 4), min_split_size));
+            scan.process(first, last);
+
+            if (splits.back().position == last) splits.pop_back();
+            if (!scan.can_split) splits.clear();
+        }
+
+        if (splits.size() > 1)
+        {
+            parallel_post_process state(splits, last, indent, linewidth,
+                threads * 2);
+            boost::thread_group workers;
+
+            for (unsigned i = 0; i < threads; ++i) {
+                workers.create_thread(
+                    boost::bind(&parallel_post_process::run, &state));
+            }
+
+            bool success = state.write(out);
+            workers.join_all();
+
+            if (!success)
+                throw quickbook::post_process_failure("Post Processing Failed.");
         }
         else
         {
-            throw quickbook::post_process_failure("Post Processing Failed.");
+            std::string tidy;
+            tidy_compiler state(tidy, &out, indent, linewidth);
+            state.process(first, last);
+            out.write(tidy.data(), tidy.size());
         }
     }
 }
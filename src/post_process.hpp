@@ -10,6 +10,7 @@
 #define BOOST_SPIRIT_QUICKBOOK_POST_PROCESS_HPP
 
 #include <string>
+#include <iosfwd>
 #include <stdexcept>
 
 namespace quickbook
@@ -19,6 +20,17 @@ namespace quickbook
       , int indent = -1
       , int linewidth = -1);
 
+    // Writes the output to 'out' as it's generated, rather than storing
+    // it all. If this throws, some of the output might already have been
+    // written. If 'threads' is more than one, large documents are split
+    // into parts which are processed in parallel.
+    void post_process(
+        std::string const& in
+      , std::ostream& out
+      , int indent = -1
+      , int linewidth = -1
+      , unsigned threads = 1);
+
     struct post_process_failure : public std::runtime_error
     {
     public:
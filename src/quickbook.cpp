@@ -17,6 +17,7 @@
 #include "stream.hpp"
 #include "path.hpp"
 #include "document_state.hpp"
+#include "watch.hpp"
 #include <boost/program_options.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -27,6 +28,26 @@
 #include <boost/foreach.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#if !defined(_WIN32)
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <signal.h>
+#endif
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#define QUICKBOOK_SERVER_SOCKETS 1
+#else
+#define QUICKBOOK_SERVER_SOCKETS 0
+#endif
 
 #include <stdexcept>
 #include <vector>
@@ -48,15 +69,24 @@ namespace quickbook
     namespace cl = boost::spirit::classic;
     namespace fs = boost::filesystem;
 
-    tm* current_time; // the current time
-    tm* current_gm_time; // the current UTC time
-    bool debug_mode; // for quickbook developers only
-    bool self_linked_headers;
-    std::vector<fs::path> include_path;
-    std::vector<std::string> preset_defines;
-    fs::path image_location;
+    namespace
+    {
+        // The time when quickbook was started, or in watch mode, when the
+        // current rebuild started. This is read before any documents are
+        // processed, as 'localtime' and 'gmtime' aren't thread safe.
+        std::tm start_local_time;
+        std::tm start_gm_time;
+    }
 
-    static void set_macros(quickbook::state& state)
+    static void record_start_time()
+    {
+        time_t t = std::time(0);
+        start_local_time = *localtime(&t);
+        start_gm_time = *gmtime(&t);
+    }
+
+    static void set_macros(quickbook::state& state,
+            std::vector<std::string> const& preset_defines)
     {
         for(std::vector<std::string>::const_iterator
                 it = preset_defines.begin(),
@@ -118,18 +148,35 @@ namespace quickbook
             indent(-1),
             linewidth(-1),
             pretty_print(true),
+            pretty_print_threads(1),
             strict_mode(false),
-            deps_out_flags(quickbook::dependency_tracker::default_)
+            deps_out_flags(quickbook::dependency_tracker::default_),
+            self_linked_headers(true),
+            debug_mode(false),
+            current_time(),
+            current_gm_time(),
+            dependencies_out(0)
         {}
 
         int indent;
         int linewidth;
         bool pretty_print;
+        unsigned pretty_print_threads;
         bool strict_mode;
         fs::path deps_out;
         quickbook::dependency_tracker::flags deps_out_flags;
         fs::path locations_out;
         fs::path xinclude_base;
+        bool self_linked_headers;
+        std::vector<fs::path> include_path;
+        std::vector<std::string> preset_defines;
+        fs::path image_location;
+        bool debug_mode;
+        std::tm current_time;
+        std::tm current_gm_time;
+
+        // If set, the document's dependencies are stored here.
+        dependency_tracker* dependencies_out;
     };
 
     static int
@@ -138,15 +185,28 @@ namespace quickbook
       , fs::path const& fileout_
       , parse_document_options const& options_)
     {
+        // The document's values are allocated from this, so it must be
+        // destroyed after everything that might hold them.
+        value_arena arena;
+
         string_stream buffer;
         document_state output;
 
         int result = 0;
 
+        // Don't let the version from a previous document leak into this one.
+        qbk_version_n = 0;
+
         try {
             quickbook::state state(filein_, options_.xinclude_base, buffer, output);
             state.strict_mode = options_.strict_mode;
-            set_macros(state);
+            state.self_linked_headers = options_.self_linked_headers;
+            state.include_path = options_.include_path;
+            state.image_location = options_.image_location;
+            state.debug_mode = options_.debug_mode;
+            state.current_time = options_.current_time;
+            state.current_gm_time = options_.current_gm_time;
+            set_macros(state, options_.preset_defines);
 
             if (state.error_count == 0) {
                 state.dependencies.add_dependency(filein_);
@@ -174,6 +234,11 @@ namespace quickbook
                 state.dependencies.write_dependencies(options_.locations_out,
                         dependency_tracker::checked);
             }
+
+            if (options_.dependencies_out)
+            {
+                options_.dependencies_out->swap(state.dependencies);
+            }
         }
         catch (load_error& e) {
             detail::outerr(filein_) << e.what() << std::endl;
@@ -186,7 +251,15 @@ namespace quickbook
 
         if (!fileout_.empty() && result == 0)
         {
-            std::string stage2 = output.replace_placeholders(buffer.str());
+            std::string stage2;
+
+            {
+                // Take the output from the buffer, so that it's freed
+                // before post processing.
+                std::string stage1;
+                buffer.swap(stage1);
+                stage2 = output.replace_placeholders(stage1);
+            }
 
             fs::ofstream fileout(fileout_);
 
@@ -203,8 +276,8 @@ namespace quickbook
             {
                 try
                 {
-                    fileout << post_process(stage2, options_.indent,
-                        options_.linewidth);
+                    post_process(stage2, fileout, options_.indent,
+                        options_.linewidth, options_.pretty_print_threads);
                 }
                 catch (quickbook::post_process_failure&)
                 {
@@ -212,6 +285,10 @@ namespace quickbook
                     ::quickbook::detail::outerr()
                         << "Post Processing Failed."
                         << std::endl;
+
+                    // Replace anything that was written before the failure.
+                    fileout.close();
+                    fileout.open(fileout_);
                     fileout << stage2;
                     return 1;
                 }
@@ -233,6 +310,848 @@ namespace quickbook
 
         return result;
     }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    //  Process the options for a single document
+    //
+    ///////////////////////////////////////////////////////////////////////////
+    namespace po = boost::program_options;
+
+#if QUICKBOOK_WIDE_PATHS
+    typedef po::wparsed_options parsed_command_line;
+    typedef po::wcommand_line_parser command_line_parser;
+#else
+    typedef po::parsed_options parsed_command_line;
+    typedef po::command_line_parser command_line_parser;
+#endif
+
+    static int
+    process_document(po::variables_map const& vm,
+            dependency_tracker* dependencies_out = 0)
+    {
+        using quickbook::detail::command_line_string;
+
+        parse_document_options options;
+        options.dependencies_out = dependencies_out;
+        bool expect_errors = vm.count("expect-errors");
+        int error_count = 0;
+
+        assert(vm.count("input-file"));
+
+        if (vm.count("no-pretty-print"))
+            options.pretty_print = false;
+
+        options.strict_mode = !!vm.count("strict");
+
+        options.self_linked_headers = !vm.count("no-self-linked-headers");
+
+        if (vm.count("indent"))
+            options.indent = vm["indent"].as<int>();
+
+        if (vm.count("linewidth"))
+            options.linewidth = vm["linewidth"].as<int>();
+
+        // When processing a single document, '--jobs' is the number of
+        // threads used for pretty printing.
+        if (vm.count("jobs"))
+        {
+            int j = vm["jobs"].as<int>();
+            options.pretty_print_threads = j > 0 ? static_cast<unsigned>(j) :
+                (std::max)(boost::thread::hardware_concurrency(), 1u);
+        }
+
+        if (vm.count("debug"))
+        {
+            std::tm timeinfo = std::tm();
+            timeinfo.tm_year = 2000 - 1900;
+            timeinfo.tm_mon = 12 - 1;
+            timeinfo.tm_mday = 20;
+            timeinfo.tm_hour = 12;
+            timeinfo.tm_min = 0;
+            timeinfo.tm_sec = 0;
+            timeinfo.tm_isdst = -1;
+            std::mktime(&timeinfo);
+            options.current_time = timeinfo;
+            options.current_gm_time = timeinfo;
+            options.debug_mode = true;
+        }
+        else
+        {
+            options.current_time = start_local_time;
+            options.current_gm_time = start_gm_time;
+            options.debug_mode = false;
+        }
+        
+        if (vm.count("include-path"))
+        {
+            boost::transform(
+                vm["include-path"].as<std::vector<command_line_string> >(),
+                std::back_inserter(options.include_path),
+                quickbook::detail::command_line_to_path);
+        }
+
+        if (vm.count("define"))
+        {
+            boost::transform(
+                vm["define"].as<std::vector<command_line_string> >(),
+                std::back_inserter(options.preset_defines),
+                quickbook::detail::command_line_to_utf8);
+        }
+
+        fs::path filein = quickbook::detail::command_line_to_path(
+            vm["input-file"].as<command_line_string>());
+        fs::path fileout;
+
+        if (!fs::exists(filein)) {
+            quickbook::detail::outerr() << "file not found: " << filein;
+            ++error_count;
+        }
+
+        bool default_output = true;
+
+        if (vm.count("no-output"))
+        {
+            default_output = false;
+        }
+
+        if (vm.count("output-deps"))
+        {
+            options.deps_out =
+                quickbook::detail::command_line_to_path(
+                    vm["output-deps"].as<command_line_string>());
+            default_output = false;
+        }
+
+        if (vm.count("output-deps-format"))
+        {
+            std::string format_flags =
+                quickbook::detail::command_line_to_utf8(
+                    vm["output-deps-format"].as<command_line_string>());
+
+            std::vector<std::string> flag_names;
+            boost::algorithm::split(flag_names, format_flags,
+                    boost::algorithm::is_any_of(", "),
+                    boost::algorithm::token_compress_on);
+
+            unsigned flags = 0;
+
+            BOOST_FOREACH(std::string const& flag, flag_names) {
+                if (flag == "checked") {
+                    flags |= quickbook::dependency_tracker::checked;
+                }
+                else if (flag == "escaped") {
+                    flags |= quickbook::dependency_tracker::escaped;
+                }
+                else if (!flag.empty()) {
+                    quickbook::detail::outerr()
+                        << "Unknown dependency format flag: "
+                        << flag
+                        <<std::endl;
+
+                    ++error_count;
+                }
+            }
+
+            options.deps_out_flags =
+                quickbook::dependency_tracker::flags(flags);
+        }
+
+        if (vm.count("output-checked-locations"))
+        {
+            options.locations_out =
+                quickbook::detail::command_line_to_path(
+                    vm["output-checked-locations"].as<command_line_string>());
+            default_output = false;
+        }
+
+        if (vm.count("output-file"))
+        {
+            fileout = quickbook::detail::command_line_to_path(
+                vm["output-file"].as<command_line_string>());
+
+            if (!fs::is_directory(fileout.parent_path()))
+            {
+                quickbook::detail::outerr()
+                    << "parent directory not found for output file";
+                ++error_count;
+            }
+        }
+        else if (default_output)
+        {
+            fileout = filein;
+            fileout.replace_extension(".xml");
+        }
+
+        if (vm.count("xinclude-base"))
+        {
+            options.xinclude_base =
+                quickbook::detail::command_line_to_path(
+                    vm["xinclude-base"].as<command_line_string>());
+
+            // I'm not sure if this error check is necessary.
+            // There might be valid reasons to use a path that doesn't
+            // exist yet, or a path that just generates valid relative
+            // paths.
+            if (!fs::is_directory(options.xinclude_base))
+            {
+                quickbook::detail::outerr()
+                    << "xinclude-base is not a directory";
+                ++error_count;
+            }
+        }
+        else
+        {
+            options.xinclude_base = fileout.parent_path();
+            if (options.xinclude_base.empty())
+                options.xinclude_base = ".";
+
+            // If fileout was implicitly created from filein, then it should be in filein's directory.
+            // If fileout was explicitly specified, then it's already been checked.
+            assert(error_count || fs::is_directory(options.xinclude_base));
+        }
+
+        if (vm.count("image-location"))
+        {
+            options.image_location = quickbook::detail::command_line_to_path(
+                vm["image-location"].as<command_line_string>());
+        }
+        else
+        {
+            options.image_location = filein.parent_path() / "html";
+        }
+
+        if (!error_count) {
+            if (!fileout.empty()) {
+                quickbook::detail::out() << "Generating Output File: "
+                    << fileout
+                    << std::endl;
+            }
+
+            error_count += quickbook::parse_document(
+                    filein, fileout, options);
+        }
+
+        if (expect_errors)
+        {
+            if (!error_count) quickbook::detail::outerr() << "No errors detected for --expect-errors." << std::endl;
+            return !error_count;
+        }
+        else
+        {
+            return error_count;
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    //  Options for documents processed in batch or server mode
+    //
+    //  These are parsed in the same way as the command line, with the
+    //  options from the actual command line used as defaults.
+    //
+    ///////////////////////////////////////////////////////////////////////////
+
+    // Options which control how quickbook runs, rather than how a
+    // document is processed.
+    static char const* const run_options[] = {
+        "batch", "file-cache-limit", "jobs", "server", "server-socket",
+        "watch"
+    };
+
+    static parsed_command_line
+    document_defaults(parsed_command_line const& command_line)
+    {
+        parsed_command_line defaults(command_line);
+
+        for (std::size_t i = 0; i < defaults.options.size();) {
+            if (boost::find(run_options, defaults.options[i].string_key) !=
+                    boost::end(run_options))
+                defaults.options.erase(defaults.options.begin() + i);
+            else
+                ++i;
+        }
+
+        return defaults;
+    }
+
+    // Throws an exception if the options are invalid.
+    static void
+    parse_document_args(
+        std::vector<detail::command_line_string> const& args
+      , po::options_description const& description
+      , po::positional_options_description const& positional
+      , parsed_command_line const& defaults
+      , po::variables_map& vm)
+    {
+        // The first value stored for an option takes precedence,
+        // so the document's options are stored before the defaults.
+        store(command_line_parser(args)
+                .options(description)
+                .positional(positional)
+                .run(), vm);
+        store(defaults, vm);
+        notify(vm);
+
+        BOOST_FOREACH(char const* option, run_options) {
+            if (vm.count(option)) {
+                throw std::runtime_error(std::string("--") + option +
+                    " can't be used for an individual document.");
+            }
+        }
+
+        if (!vm.count("input-file")) {
+            throw std::runtime_error("No filename given.");
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    //  Batch mode
+    //
+    //  Each line of the manifest contains the options for a single
+    //  document. Blank lines, and lines starting with '#' are ignored.
+    //
+    //  The documents are all processed in this process, so files shared
+    //  by several documents are only read once. If 'jobs' is greater than
+    //  one, the documents are processed in parallel, with the messages for
+    //  each document buffered so that they're written out together.
+    //
+    ///////////////////////////////////////////////////////////////////////////
+
+    static bool
+    process_batch_entry(po::variables_map const& vm,
+            dependency_tracker* dependencies_out)
+    {
+        try {
+            return process_document(vm, dependencies_out) == 0;
+        }
+        catch (std::exception& e) {
+            detail::outerr() << e.what() << "\n";
+            return false;
+        }
+    }
+
+    namespace
+    {
+        // A queue of documents, shared by the threads processing them.
+        struct batch_queue
+        {
+            batch_queue(std::vector<po::variables_map> const& x,
+                    dependency_tracker* dependencies_)
+                : entries(x), dependencies(dependencies_),
+                next(0), failures(0), mutex() {}
+
+            void run()
+            {
+                detail::buffered_output output;
+
+                for (;;)
+                {
+                    std::size_t index;
+
+                    {
+                        boost::lock_guard<boost::mutex> lock(mutex);
+                        if (next == entries.size()) return;
+                        index = next++;
+                    }
+
+                    bool success = process_batch_entry(entries[index],
+                        dependencies ? &dependencies[index] : 0);
+                    output.flush();
+
+                    if (!success) {
+                        boost::lock_guard<boost::mutex> lock(mutex);
+                        ++failures;
+                    }
+                }
+            }
+
+            std::vector<po::variables_map> const& entries;
+            dependency_tracker* dependencies;
+            std::size_t next;
+            int failures;
+            boost::mutex mutex;
+        };
+    }
+
+    // Returns the number of failures. If 'dependencies' is set, it points
+    // to an array where each document's dependencies are stored.
+    static int
+    process_documents(
+        std::vector<po::variables_map> const& entries
+      , unsigned jobs
+      , dependency_tracker* dependencies = 0)
+    {
+        int failures = 0;
+
+        if (jobs > entries.size()) jobs = static_cast<unsigned>(entries.size());
+
+        if (jobs <= 1) {
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                if (!process_batch_entry(entries[i],
+                        dependencies ? &dependencies[i] : 0))
+                    ++failures;
+            }
+        }
+        else {
+            batch_queue queue(entries, dependencies);
+            boost::thread_group threads;
+
+            for (unsigned i = 0; i < jobs; ++i) {
+                threads.create_thread(
+                    boost::bind(&batch_queue::run, &queue));
+            }
+
+            threads.join_all();
+            failures += queue.failures;
+        }
+
+        return failures;
+    }
+
+    // Reads the documents' options from a manifest, returns the number
+    // of invalid entries.
+    static int
+    read_batch_manifest(
+        fs::path const& manifest
+      , po::options_description const& description
+      , po::positional_options_description const& positional
+      , parsed_command_line const& command_line
+      , std::vector<po::variables_map>& entries)
+    {
+        fs::ifstream in(manifest);
+
+        if (!in) {
+            detail::outerr(manifest) << "Could not open batch manifest."
+                << std::endl;
+            return 1;
+        }
+
+        parsed_command_line defaults = document_defaults(command_line);
+        int failures = 0;
+        std::ptrdiff_t line_number = 0;
+        std::string line;
+
+        while (std::getline(in, line))
+        {
+            ++line_number;
+
+            std::string::size_type start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos || line[start] == '#') continue;
+
+            po::variables_map vm;
+
+            try {
+#if QUICKBOOK_WIDE_PATHS
+                std::vector<std::wstring> args =
+                    po::split_unix(detail::from_utf8(line), L" \t\r");
+#else
+                std::vector<std::string> args =
+                    po::split_unix(line, " \t\r");
+#endif
+
+                parse_document_args(args, description, positional,
+                    defaults, vm);
+            }
+            catch (std::exception& e) {
+                detail::outerr(manifest, line_number) << e.what()
+                    << std::endl;
+                ++failures;
+                continue;
+            }
+
+            entries.push_back(vm);
+        }
+
+        if (in.bad()) {
+            detail::outerr(manifest) << "Error reading batch manifest."
+                << std::endl;
+            ++failures;
+        }
+
+        return failures;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    //  Watch mode
+    //
+    //  After processing the documents, waits for the files they depended
+    //  on to change and then processes them again. Only the documents
+    //  which might be affected by a change are processed, and only the
+    //  changed files are removed from the cache.
+    //
+    //  The directories containing every file that was checked are
+    //  watched, rather than the files themselves, so that creating a
+    //  file that was missing, or one that matches a glob, is noticed.
+    //
+    ///////////////////////////////////////////////////////////////////////////
+
+    // Only returns by throwing an exception.
+    static void
+    watch_documents(
+        std::vector<po::variables_map> const& entries
+      , unsigned jobs)
+    {
+        directory_watcher watcher;
+        boost::scoped_array<dependency_tracker> dependencies(
+            new dependency_tracker[entries.size()]);
+        std::vector<bool> rebuild(entries.size(), true);
+
+        for (;;)
+        {
+            std::vector<po::variables_map> rebuild_entries;
+            std::vector<std::size_t> rebuild_indexes;
+
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                if (rebuild[i]) {
+                    rebuild_entries.push_back(entries[i]);
+                    rebuild_indexes.push_back(i);
+                    rebuild[i] = false;
+                }
+            }
+
+            if (!rebuild_entries.empty())
+            {
+                boost::scoped_array<dependency_tracker> rebuild_dependencies(
+                    new dependency_tracker[rebuild_entries.size()]);
+
+                // If the input file can't be loaded, its dependencies
+                // aren't stored, so make sure that it's still watched.
+                for (std::size_t i = 0; i < rebuild_entries.size(); ++i) {
+                    rebuild_dependencies[i].add_dependency(
+                        detail::command_line_to_path(rebuild_entries[i]
+                            ["input-file"].as<detail::command_line_string>()));
+                }
+
+                record_start_time();
+                process_documents(rebuild_entries, jobs,
+                    rebuild_dependencies.get());
+
+                for (std::size_t i = 0; i < rebuild_entries.size(); ++i) {
+                    dependencies[rebuild_indexes[i]].swap(
+                        rebuild_dependencies[i]);
+
+                    BOOST_FOREACH(fs::path const& directory,
+                        dependencies[rebuild_indexes[i]].get_directories())
+                    {
+                        watcher.add(directory);
+                    }
+                }
+
+                detail::out() << "Waiting for changes..." << std::endl;
+            }
+
+            std::vector<watched_change> changes;
+
+            if (!watcher.wait(changes))
+            {
+                // Some changes were missed, so start again.
+                check_cached_files();
+                rebuild.assign(entries.size(), true);
+                continue;
+            }
+
+            BOOST_FOREACH(watched_change const& change, changes)
+            {
+                fs::path parent = change.path.parent_path();
+                forget_file(change.path);
+                forget_file(parent.empty() ? fs::path(".") : parent);
+
+                bool affected = false;
+
+                for (std::size_t i = 0; i < entries.size(); ++i) {
+                    if (dependencies[i].affected_by(change.path)) {
+                        rebuild[i] = true;
+                        affected = true;
+                    }
+                }
+
+                // A new directory might contain files matching a glob.
+                if (affected && change.is_directory) {
+                    watcher.add(change.path);
+                }
+            }
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    //  Server mode
+    //
+    //  Reads requests, one JSON object per line, and writes a JSON object
+    //  on a single line in response to each one. A request looks like:
+    //
+    //      {"input": "doc.qbk", "output": "doc.xml",
+    //          "define": ["__foo__=bar"], "include_path": ["include"]}
+    //
+    //  Only "input" is required, if "output" isn't given, no output file
+    //  is written. Any other command line options can be given as an
+    //  array in "options". The response looks like:
+    //
+    //      {"success": true, "diagnostics": "...",
+    //          "dependencies": ["doc.qbk", "include/foo.qbk"]}
+    //
+    //  "diagnostics" contains the messages that would have been written
+    //  to the console for the document. Loaded files and directory
+    //  listings are kept between requests, and only read again if they've
+    //  been modified.
+    //
+    ///////////////////////////////////////////////////////////////////////////
+
+    static std::string
+    json_string(std::string const& x)
+    {
+        static char const hex[] = "0123456789abcdef";
+        std::string result = "\"";
+
+        BOOST_FOREACH(char c, x)
+        {
+            switch (c)
+            {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if (c >= 0 && c < 0x20) {
+                    result += "\\u00";
+                    result += hex[(c >> 4) & 0xf];
+                    result += hex[c & 0xf];
+                }
+                else {
+                    result += c;
+                }
+            }
+        }
+
+        return result + "\"";
+    }
+
+    static detail::command_line_string
+    to_command_line(std::string const& x)
+    {
+#if QUICKBOOK_WIDE_PATHS
+        return detail::from_utf8(x);
+#else
+        return x;
+#endif
+    }
+
+    // Add an option for each value of 'key', which can be a string,
+    // or an array of strings. If 'option' is null, the values are
+    // added as they are. Property trees don't distinguish between an
+    // empty array and an empty string, so both are ignored.
+    static void
+    add_request_args(
+        std::vector<detail::command_line_string>& args
+      , boost::property_tree::ptree const& request
+      , char const* key
+      , char const* option)
+    {
+        boost::optional<boost::property_tree::ptree const&> values =
+            request.get_child_optional(key);
+        if (!values) return;
+
+        if (values->empty() && !values->data().empty()) {
+            if (option) args.push_back(to_command_line(option));
+            args.push_back(to_command_line(values->data()));
+        }
+
+        BOOST_FOREACH(boost::property_tree::ptree::value_type const& v,
+                *values)
+        {
+            if (option) args.push_back(to_command_line(option));
+            args.push_back(to_command_line(v.second.data()));
+        }
+    }
+
+    static std::string
+    process_request(
+        std::string const& line
+      , po::options_description const& description
+      , po::positional_options_description const& positional
+      , parsed_command_line const& defaults)
+    {
+        bool success = false;
+        dependency_tracker dependencies;
+        std::string diagnostics;
+
+        {
+            detail::buffered_output output;
+
+            try {
+                boost::property_tree::ptree request;
+                std::istringstream request_stream(line);
+                boost::property_tree::read_json(request_stream, request);
+
+                std::vector<detail::command_line_string> args;
+                add_request_args(args, request, "input", "--input-file");
+                add_request_args(args, request, "output", "--output-file");
+                add_request_args(args, request, "define", "--define");
+                add_request_args(args, request, "include_path",
+                    "--include-path");
+                add_request_args(args, request, "options", 0);
+                if (!request.get_child_optional("output")) {
+                    args.push_back(to_command_line("--no-output"));
+                }
+
+                po::variables_map vm;
+                parse_document_args(args, description, positional,
+                    defaults, vm);
+
+                check_cached_files();
+                success = process_document(vm, &dependencies) == 0;
+            }
+            catch (std::exception& e) {
+                detail::outerr() << e.what() << "\n";
+            }
+
+            diagnostics = output.release();
+        }
+
+        std::string response = "{\"success\": ";
+        response += success ? "true" : "false";
+        response += ", \"diagnostics\": ";
+        response += json_string(diagnostics);
+        response += ", \"dependencies\": [";
+
+        std::string separator = "";
+        BOOST_FOREACH(std::string const& p,
+                dependencies.get_dependencies())
+        {
+            response += separator;
+            response += json_string(p);
+            separator = ", ";
+        }
+
+        response += "]}";
+        return response;
+    }
+
+    static void
+    serve(
+        std::istream& in
+      , std::ostream& out
+      , po::options_description const& description
+      , po::positional_options_description const& positional
+      , parsed_command_line const& defaults)
+    {
+        std::string line;
+
+        while (std::getline(in, line))
+        {
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+
+            out << process_request(line, description, positional, defaults)
+                << std::endl;
+        }
+    }
+
+#if QUICKBOOK_SERVER_SOCKETS
+    // Removes the server's socket file when it stops, either because of
+    // an error, or because it was sent SIGINT or SIGTERM. The signal
+    // handlers are installed on construction, so that a signal isn't
+    // missed, but the file isn't touched until 'start' is called, after
+    // the socket has been bound. The signals are blocked in the calling
+    // thread, so that they're only received by the cleanup thread, rather
+    // than interrupting the server.
+    struct socket_file_cleanup
+    {
+        fs::path path;
+        boost::asio::io_context context;
+        boost::asio::signal_set signals;
+        sigset_t signal_mask;
+        boost::thread thread;
+
+        explicit socket_file_cleanup(fs::path const& path_)
+          : path(path_),
+            context(),
+            signals(context, SIGINT, SIGTERM),
+            signal_mask(),
+            thread()
+        {
+            sigemptyset(&signal_mask);
+            sigaddset(&signal_mask, SIGINT);
+            sigaddset(&signal_mask, SIGTERM);
+        }
+
+        ~socket_file_cleanup()
+        {
+            if (thread.joinable()) {
+                context.stop();
+                thread.join();
+                remove();
+                pthread_sigmask(SIG_UNBLOCK, &signal_mask, 0);
+            }
+        }
+
+        void start()
+        {
+            signals.async_wait(boost::bind(
+                &socket_file_cleanup::stop, this, _1, _2));
+            pthread_sigmask(SIG_BLOCK, &signal_mask, 0);
+            thread = boost::thread(
+                boost::bind(&socket_file_cleanup::run, this));
+        }
+
+        void run()
+        {
+            pthread_sigmask(SIG_UNBLOCK, &signal_mask, 0);
+            context.run();
+        }
+
+        void remove()
+        {
+            boost::system::error_code ec;
+            fs::remove(path, ec);
+        }
+
+        // Remove the socket, and then exit by the signal.
+        void stop(boost::system::error_code const& ec, int signal_number)
+        {
+            if (ec) return;
+            remove();
+            signal(signal_number, SIG_DFL);
+            raise(signal_number);
+        }
+    };
+
+    // Accepts connections one at a time, serving each one until it's
+    // closed by the client.
+    static int
+    serve_socket(
+        fs::path const& socket_path
+      , po::options_description const& description
+      , po::positional_options_description const& positional
+      , parsed_command_line const& defaults)
+    {
+        namespace local = boost::asio::local;
+
+        socket_file_cleanup cleanup(socket_path);
+
+        // A server that wasn't stopped cleanly leaves its socket behind,
+        // which would stop this one from binding.
+        boost::system::error_code ec;
+        if (fs::status(socket_path, ec).type() == fs::socket_file)
+            fs::remove(socket_path, ec);
+
+        boost::asio::io_context io_context;
+        local::stream_protocol::acceptor acceptor(io_context,
+            local::stream_protocol::endpoint(socket_path.string()));
+        cleanup.start();
+
+        for (;;)
+        {
+            local::stream_protocol::iostream stream;
+            acceptor.accept(stream.socket());
+            serve(stream, stream, description, positional, defaults);
+        }
+    }
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -251,9 +1170,6 @@ main(int argc, char* argv[])
         using boost::program_options::options_description;
         using boost::program_options::variables_map;
         using boost::program_options::store;
-        using boost::program_options::parse_command_line;
-        using boost::program_options::wcommand_line_parser;
-        using boost::program_options::command_line_parser;
         using boost::program_options::notify;
         using boost::program_options::positional_options_description;
         
@@ -295,6 +1211,26 @@ main(int argc, char* argv[])
             ("include-path,I", PO_VALUE< std::vector<command_line_string> >(), "include path")
             ("define,D", PO_VALUE< std::vector<command_line_string> >(), "define macro")
             ("image-location", PO_VALUE<command_line_string>(), "image location")
+            ("batch", PO_VALUE<command_line_string>(),
+             "process several documents, reading the options for each "
+             "document from a line in the given file")
+            ("jobs,j", PO_VALUE<int>(),
+             "number of documents to process in parallel in batch mode, "
+             "or threads to pretty print a single document with, "
+             "0 to use every core")
+            ("watch",
+             "after processing, wait for the files that were used to "
+             "change, and process the affected documents again")
+            ("server",
+             "process documents as requested by JSON objects read from "
+             "standard input, writing the results to standard output")
+#if QUICKBOOK_SERVER_SOCKETS
+            ("server-socket", PO_VALUE<command_line_string>(),
+             "run as a server, accepting connections on the given unix "
+             "domain socket")
+#endif
+            ("file-cache-limit", PO_VALUE<int>(),
+             "maximum size of the cached files, in megabytes")
         ;
 
         hidden.add_options()
@@ -337,27 +1273,29 @@ main(int argc, char* argv[])
             return 1;
         }
 
-        store(
-            wcommand_line_parser(wide_argc, wide_argv)
+        parsed_command_line command_line =
+            quickbook::command_line_parser(wide_argc, wide_argv)
                 .options(all)
                 .positional(p)
-                .run(), vm);
+                .run();
 
         LocalFree(wide_argv);
 #else
-        store(command_line_parser(argc, argv)
+        parsed_command_line command_line =
+            quickbook::command_line_parser(argc, argv)
                 .options(all)
                 .positional(p)
-                .run(), vm);
+                .run();
 #endif
 
+        store(command_line, vm);
         notify(vm);
 
         // Process the command line options
 
-        parse_document_options options;
-        bool expect_errors = vm.count("expect-errors");
-        int error_count = 0;
+        quickbook::detail::set_ms_errors(vm.count("ms-errors"));
+
+        quickbook::record_start_time();
 
         if (vm.count("help"))
         {
@@ -383,208 +1321,105 @@ main(int argc, char* argv[])
             return 0;
         }
 
-        quickbook::detail::set_ms_errors(vm.count("ms-errors"));
-
-        if (vm.count("no-pretty-print"))
-            options.pretty_print = false;
-
-        options.strict_mode = !!vm.count("strict");
-
-        quickbook::self_linked_headers = !vm.count("no-self-linked-headers");
-
-        if (vm.count("indent"))
-            options.indent = vm["indent"].as<int>();
-
-        if (vm.count("linewidth"))
-            options.linewidth = vm["linewidth"].as<int>();
-
-        if (vm.count("debug"))
-        {
-            static tm timeinfo;
-            timeinfo.tm_year = 2000 - 1900;
-            timeinfo.tm_mon = 12 - 1;
-            timeinfo.tm_mday = 20;
-            timeinfo.tm_hour = 12;
-            timeinfo.tm_min = 0;
-            timeinfo.tm_sec = 0;
-            timeinfo.tm_isdst = -1;
-            mktime(&timeinfo);
-            quickbook::current_time = &timeinfo;
-            quickbook::current_gm_time = &timeinfo;
-            quickbook::debug_mode = true;
-        }
-        else
+        if (vm.count("jobs") && !vm.count("batch") && !vm.count("input-file"))
         {
-            time_t t = std::time(0);
-            static tm lt = *localtime(&t);
-            static tm gmt = *gmtime(&t);
-            quickbook::current_time = &lt;
-            quickbook::current_gm_time = &gmt;
-            quickbook::debug_mode = false;
+            quickbook::detail::outerr()
+                << "--jobs can only be used with --batch or an input file.\n";
+            return 1;
         }
-        
-        quickbook::include_path.clear();
-        if (vm.count("include-path"))
+
+        if (vm.count("file-cache-limit"))
         {
-            boost::transform(
-                vm["include-path"].as<std::vector<command_line_string> >(),
-                std::back_inserter(quickbook::include_path),
-                quickbook::detail::command_line_to_path);
+            int limit = vm["file-cache-limit"].as<int>();
+
+            if (limit < 0)
+            {
+                quickbook::detail::outerr()
+                    << "--file-cache-limit can't be negative.\n";
+                return 1;
+            }
+
+            quickbook::set_file_cache_limit(
+                static_cast<boost::uintmax_t>(limit) * 1024 * 1024);
         }
 
-        quickbook::preset_defines.clear();
-        if (vm.count("define"))
+        // Files are kept between documents in the long running modes, so
+        // they mustn't change if they're modified on disk.
+        if (vm.count("server") || vm.count("server-socket") ||
+                vm.count("batch") || vm.count("watch"))
         {
-            boost::transform(
-                vm["define"].as<std::vector<command_line_string> >(),
-                std::back_inserter(quickbook::preset_defines),
-                quickbook::detail::command_line_to_utf8);
+            quickbook::set_map_files(false);
         }
 
-        if (vm.count("input-file"))
+        if (vm.count("server") || vm.count("server-socket"))
         {
-            fs::path filein = quickbook::detail::command_line_to_path(
-                vm["input-file"].as<command_line_string>());
-            fs::path fileout;
-
-            if (!fs::exists(filein)) {
-                quickbook::detail::outerr() << "file not found: " << filein;
-                ++error_count;
-            }
-
-            bool default_output = true;
-
-            if (vm.count("no-output"))
+            if (vm.count("input-file") || vm.count("batch") ||
+                    vm.count("watch"))
             {
-                default_output = false;
+                quickbook::detail::outerr()
+                    << "Input files can't be given in server mode.\n";
+                return 1;
             }
 
-            if (vm.count("output-deps"))
+            parsed_command_line defaults =
+                quickbook::document_defaults(command_line);
+
+#if QUICKBOOK_SERVER_SOCKETS
+            if (vm.count("server-socket"))
             {
-                options.deps_out =
+                return quickbook::serve_socket(
                     quickbook::detail::command_line_to_path(
-                        vm["output-deps"].as<command_line_string>());
-                default_output = false;
+                        vm["server-socket"].as<command_line_string>()),
+                    all, p, defaults);
             }
+#endif
 
-            if (vm.count("output-deps-format"))
+            quickbook::serve(std::cin, std::cout, all, p, defaults);
+            return 0;
+        }
+        else if (vm.count("batch"))
+        {
+            if (vm.count("input-file"))
             {
-                std::string format_flags =
-                    quickbook::detail::command_line_to_utf8(
-                        vm["output-deps-format"].as<command_line_string>());
-
-                std::vector<std::string> flag_names;
-                boost::algorithm::split(flag_names, format_flags,
-                        boost::algorithm::is_any_of(", "),
-                        boost::algorithm::token_compress_on);
-
-                unsigned flags = 0;
-
-                BOOST_FOREACH(std::string const& flag, flag_names) {
-                    if (flag == "checked") {
-                        flags |= quickbook::dependency_tracker::checked;
-                    }
-                    else if (flag == "escaped") {
-                        flags |= quickbook::dependency_tracker::escaped;
-                    }
-                    else if (!flag.empty()) {
-                        quickbook::detail::outerr()
-                            << "Unknown dependency format flag: "
-                            << flag
-                            <<std::endl;
-
-                        ++error_count;
-                    }
-                }
-
-                options.deps_out_flags =
-                    quickbook::dependency_tracker::flags(flags);
+                quickbook::detail::outerr()
+                    << "Input files can't be given with --batch.\n";
+                return 1;
             }
 
-            if (vm.count("output-checked-locations"))
-            {
-                options.locations_out =
-                    quickbook::detail::command_line_to_path(
-                        vm["output-checked-locations"].as<command_line_string>());
-                default_output = false;
-            }
+            unsigned jobs = 1;
 
-            if (vm.count("output-file"))
+            if (vm.count("jobs"))
             {
-                fileout = quickbook::detail::command_line_to_path(
-                    vm["output-file"].as<command_line_string>());
-
-                if (!fs::is_directory(fileout.parent_path()))
-                {
-                    quickbook::detail::outerr()
-                        << "parent directory not found for output file";
-                    ++error_count;
-                }
-            }
-            else if (default_output)
-            {
-                fileout = filein;
-                fileout.replace_extension(".xml");
+                int j = vm["jobs"].as<int>();
+                jobs = j > 0 ? static_cast<unsigned>(j) :
+                    (std::max)(boost::thread::hardware_concurrency(), 1u);
             }
 
-            if (vm.count("xinclude-base"))
-            {
-                options.xinclude_base =
-                    quickbook::detail::command_line_to_path(
-                        vm["xinclude-base"].as<command_line_string>());
+            std::vector<variables_map> entries;
+            int failures = quickbook::read_batch_manifest(
+                quickbook::detail::command_line_to_path(
+                    vm["batch"].as<command_line_string>()),
+                all, p, command_line, entries);
 
-                // I'm not sure if this error check is necessary.
-                // There might be valid reasons to use a path that doesn't
-                // exist yet, or a path that just generates valid relative
-                // paths.
-                if (!fs::is_directory(options.xinclude_base))
-                {
-                    quickbook::detail::outerr()
-                        << "xinclude-base is not a directory";
-                    ++error_count;
-                }
-            }
-            else
+            if (vm.count("watch"))
             {
-                options.xinclude_base = fileout.parent_path();
-                if (options.xinclude_base.empty())
-                    options.xinclude_base = ".";
-
-                // If fileout was implicitly created from filein, then it should be in filein's directory.
-                // If fileout was explicitly specified, then it's already been checked.
-                assert(error_count || fs::is_directory(options.xinclude_base));
+                quickbook::watch_documents(entries, jobs);
+                return 1;
             }
 
-            if (vm.count("image-location"))
-            {
-                quickbook::image_location = quickbook::detail::command_line_to_path(
-                    vm["image-location"].as<command_line_string>());
-            }
-            else
+            failures += quickbook::process_documents(entries, jobs);
+            return failures ? 1 : 0;
+        }
+        else if (vm.count("input-file"))
+        {
+            if (vm.count("watch"))
             {
-                quickbook::image_location = filein.parent_path() / "html";
-            }
-
-            if (!error_count) {
-                if (!fileout.empty()) {
-                    quickbook::detail::out() << "Generating Output File: "
-                        << fileout
-                        << std::endl;
-                }
-
-                error_count += quickbook::parse_document(
-                        filein, fileout, options);
+                quickbook::watch_documents(
+                    std::vector<variables_map>(1, vm), 1);
+                return 1;
             }
 
-            if (expect_errors)
-            {
-                if (!error_count) quickbook::detail::outerr() << "No errors detected for --expect-errors." << std::endl;
-                return !error_count;
-            }
-            else
-            {
-                return error_count;
-            }
+            return quickbook::process_document(vm);
         }
         else
         {
@@ -12,7 +12,6 @@
 #if !defined(BOOST_SPIRIT_QUICKBOOK_QUICKBOOK_HPP)
 #define BOOST_SPIRIT_QUICKBOOK_QUICKBOOK_HPP
 
-#include <time.h>
 #include <vector>
 #include <string>
 #include <boost/filesystem/path.hpp>
@@ -23,14 +22,6 @@ namespace quickbook
 {
     namespace fs = boost::filesystem;
 
-    extern tm* current_time; // the current time
-    extern tm* current_gm_time; // the current UTC time
-    extern bool debug_mode;
-    extern bool self_linked_headers;
-    extern std::vector<fs::path> include_path;
-    extern std::vector<std::string> preset_defines;
-    extern fs::path image_location;
-
     void parse_file(quickbook::state& state,
             value include_doc_id = value(),
             bool nested_file = false);
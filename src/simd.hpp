@@ -0,0 +1,134 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+// Helpers for scanning text a block at a time, using SSE2 or AVX2 when
+// the compiler targets them. Define QUICKBOOK_NO_SIMD to always use the
+// portable code.
+
+#if !defined(BOOST_QUICKBOOK_SIMD_HPP)
+#define BOOST_QUICKBOOK_SIMD_HPP
+
+#include <cstddef>
+#include <cstring>
+
+#if !defined(QUICKBOOK_NO_SIMD) && defined(__AVX2__)
+#   define QUICKBOOK_SIMD_AVX2 1
+#   include <immintrin.h>
+#elif !defined(QUICKBOOK_NO_SIMD) && (defined(__SSE2__) || \
+        defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#   define QUICKBOOK_SIMD_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+#if QUICKBOOK_SIMD_AVX2 || QUICKBOOK_SIMD_SSE2
+#   define QUICKBOOK_SIMD 1
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#   endif
+#else
+#   define QUICKBOOK_SIMD 0
+#endif
+
+namespace quickbook
+{
+namespace simd
+{
+#if QUICKBOOK_SIMD_AVX2
+    typedef __m256i block;
+    std::size_t const block_size = 32;
+
+    inline block load(char const* x)
+        { return _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x)); }
+    inline block splat(char c) { return _mm256_set1_epi8(c); }
+
+    // Returns a bit mask of the characters in 'x' which equal those in 'c'.
+    inline unsigned match(block x, block c)
+    {
+        return static_cast<unsigned>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, c)));
+    }
+#elif QUICKBOOK_SIMD_SSE2
+    typedef __m128i block;
+    std::size_t const block_size = 16;
+
+    inline block load(char const* x)
+        { return _mm_loadu_si128(reinterpret_cast<__m128i const*>(x)); }
+    inline block splat(char c) { return _mm_set1_epi8(c); }
+
+    // Returns a bit mask of the characters in 'x' which equal those in 'c'.
+    inline unsigned match(block x, block c)
+    {
+        return static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(x, c)));
+    }
+#endif
+
+#if QUICKBOOK_SIMD
+    // Index of the lowest set bit, 'x' mustn't be 0.
+    inline unsigned first_bit(unsigned x)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, x);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(x));
+#endif
+    }
+#endif
+
+    // Returns a pointer to the first 'c' in [begin, end), or 'end'.
+    inline char const* find(char const* begin, char const* end, char c)
+    {
+#if QUICKBOOK_SIMD
+        block const c_block = splat(c);
+
+        for (; end - begin >= static_cast<std::ptrdiff_t>(block_size);
+                begin += block_size)
+        {
+            unsigned mask = match(load(begin), c_block);
+            if (mask) return begin + first_bit(mask);
+        }
+#endif
+
+        void const* r = std::memchr(begin, c, end - begin);
+        return r ? static_cast<char const*>(r) : end;
+    }
+
+    // Returns a pointer to the first character in [begin, end) that's
+    // one of 'c1', 'c2', 'c3' or 'c4', or 'end'.
+    inline char const* find_any(char const* begin, char const* end,
+            char c1, char c2, char c3, char c4)
+    {
+#if QUICKBOOK_SIMD
+        block const c1_block = splat(c1);
+        block const c2_block = splat(c2);
+        block const c3_block = splat(c3);
+        block const c4_block = splat(c4);
+
+        for (; end - begin >= static_cast<std::ptrdiff_t>(block_size);
+                begin += block_size)
+        {
+            block x = load(begin);
+            unsigned mask = match(x, c1_block) | match(x, c2_block) |
+                match(x, c3_block) | match(x, c4_block);
+            if (mask) return begin + first_bit(mask);
+        }
+#endif
+
+        for (; begin != end; ++begin) {
+            char c = *begin;
+            if (c == c1 || c == c2 || c == c3 || c == c4) break;
+        }
+
+        return begin;
+    }
+}
+}
+
+#endif
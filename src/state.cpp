@@ -27,7 +27,7 @@ namespace quickbook
     char const* quickbook_get_date = "__quickbook_get_date__";
     char const* quickbook_get_time = "__quickbook_get_time__";
 
-    unsigned qbk_version_n = 0; // qbk_major_version * 100 + qbk_minor_version
+    QUICKBOOK_THREAD_LOCAL unsigned qbk_version_n = 0; // qbk_major_version * 100 + qbk_minor_version
 
     state::state(fs::path const& filein_, fs::path const& xinclude_base_,
             string_stream& out_, document_state& document_)
@@ -48,6 +48,13 @@ namespace quickbook
         , explicit_list(false)
         , strict_mode(false)
 
+        , self_linked_headers(true)
+        , include_path()
+        , image_location()
+        , debug_mode(false)
+        , current_time()
+        , current_gm_time()
+
         , imported(false)
         , macro()
         , source_mode()
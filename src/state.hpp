@@ -11,7 +11,10 @@
 #define BOOST_SPIRIT_ACTIONS_CLASS_HPP
 
 #include <map>
+#include <stack>
+#include <ctime>
 #include <boost/scoped_ptr.hpp>
+#include <boost/config.hpp>
 #include "parsers.hpp"
 #include "values_parse.hpp"
 #include "collector.hpp"
@@ -58,6 +61,14 @@ namespace quickbook
         bool                    explicit_list;      // set when using a list
         bool                    strict_mode;
 
+    // document settings
+        bool                    self_linked_headers;
+        std::vector<fs::path>   include_path;
+        fs::path                image_location;
+        bool                    debug_mode;         // for quickbook developers only
+        std::tm                 current_time;       // the current time
+        std::tm                 current_gm_time;    // the current UTC time
+
     // state saved for files and templates.
         bool                    imported;
         string_symbols          macro;
@@ -112,7 +123,10 @@ namespace quickbook
         void pop_tagged_source_mode();
     };
 
-    extern unsigned qbk_version_n; // qbk_major_version * 100 + qbk_minor_version
+    // The version of the file currently being processed. This is thread
+    // local so that several documents can be processed in parallel.
+
+    extern QUICKBOOK_THREAD_LOCAL unsigned qbk_version_n; // qbk_major_version * 100 + qbk_minor_version
     extern char const* quickbook_get_date;
     extern char const* quickbook_get_time;
 }
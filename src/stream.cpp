@@ -9,6 +9,10 @@
 #include "stream.hpp"
 #include "path.hpp"
 #include "files.hpp"
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <sstream>
 
 #if QUICKBOOK_WIDE_PATHS || QUICKBOOK_WIDE_STREAMS
 #include <io.h>
@@ -19,8 +23,32 @@ namespace quickbook {
 namespace detail {
     namespace {
         bool ms_errors = false;
+
+        // 'buffered_output' for the current thread, if there is one.
+        // The cleanup function does nothing, as the object is owned by
+        // whoever created it.
+        void no_cleanup(buffered_output::impl*) {}
+        boost::thread_specific_ptr<buffered_output::impl>
+            thread_output(&no_cleanup);
+
+        // Used to write out buffered output one thread at a time.
+        boost::mutex output_mutex;
     }
 
+    struct buffered_output::impl
+    {
+        typedef std::basic_ostringstream<ostream::string::value_type>
+            buffer_type;
+
+        impl() : out_buffer(), err_buffer(),
+            out(out_buffer), err(err_buffer) {}
+
+        buffer_type out_buffer;
+        buffer_type err_buffer;
+        ostream out;
+        ostream err;
+    };
+
     void set_ms_errors(bool x) {
         ms_errors = x;
     }
@@ -38,15 +66,15 @@ namespace detail {
         out << from_utf8(x);
     }
 
-    ostream& out()
-    {
-        static ostream x(std::wcout);
-        return x;
-    }
-
     namespace
     {
-        inline ostream& error_stream()
+        inline ostream& standard_out()
+        {
+            static ostream x(std::wcout);
+            return x;
+        }
+
+        inline ostream& standard_error()
         {
             static ostream x(std::wcerr);
             return x;
@@ -64,22 +92,75 @@ namespace detail {
         out << x;
     }
 
+    namespace
+    {
+        inline ostream& standard_out()
+        {
+            static ostream x(std::cout);
+            return x;
+        }
+
+        inline ostream& standard_error()
+        {
+            static ostream x(std::clog);
+            return x;
+        }
+    }
+
+#endif
+
     ostream& out()
     {
-        static ostream x(std::cout);
-        return x;
+        buffered_output::impl* buffer = thread_output.get();
+        return buffer ? buffer->out : standard_out();
     }
 
     namespace
     {
         inline ostream& error_stream()
         {
-            static ostream x(std::clog);
-            return x;
+            buffered_output::impl* buffer = thread_output.get();
+            return buffer ? buffer->err : standard_error();
         }
     }
 
+    buffered_output::buffered_output() : impl_(new impl)
+    {
+        assert(!thread_output.get());
+        thread_output.reset(impl_.get());
+    }
+
+    buffered_output::~buffered_output()
+    {
+        flush();
+        thread_output.reset();
+    }
+
+    void buffered_output::flush()
+    {
+        boost::lock_guard<boost::mutex> lock(output_mutex);
+
+        standard_out().base << impl_->out_buffer.str() << std::flush;
+        standard_error().base << impl_->err_buffer.str() << std::flush;
+
+        impl_->out_buffer.str(ostream::string());
+        impl_->err_buffer.str(ostream::string());
+    }
+
+    std::string buffered_output::release()
+    {
+        ostream::string result =
+            impl_->out_buffer.str() + impl_->err_buffer.str();
+
+        impl_->out_buffer.str(ostream::string());
+        impl_->err_buffer.str(ostream::string());
+
+#if QUICKBOOK_WIDE_STREAMS
+        return to_utf8(result);
+#else
+        return result;
 #endif
+    }
 
     ostream& outerr()
     {
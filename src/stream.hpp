@@ -13,6 +13,7 @@
 
 #include "native_text.hpp"
 #include <boost/filesystem/path.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <iostream>
 
 namespace quickbook
@@ -67,6 +68,26 @@ namespace quickbook
 
         void initialise_output();
 
+        // While one of these exists, 'out', 'outerr' and 'outwarn' write to
+        // a buffer for the current thread, so that the messages for
+        // documents processed in parallel aren't mixed together. The
+        // buffered output is written out by 'flush', or on destruction.
+        // 'release' returns the buffered output as UTF-8 instead.
+        struct buffered_output
+        {
+            buffered_output();
+            ~buffered_output();
+            void flush();
+            std::string release();
+
+            struct impl;
+        private:
+            buffered_output(buffered_output const&);
+            buffered_output& operator=(buffered_output const&);
+
+            boost::scoped_ptr<impl> impl_;
+        };
+
         ostream& out();
 
         // Preformats an error/warning message so that it can be parsed by
@@ -61,8 +61,8 @@ namespace quickbook
             parse_iterator last, char const* name)
     {
         state.phrase << "<phrase role=\"" << name << "\">";
-        while (first != last)
-            detail::print_char(*first++, state.phrase.get());
+        detail::print_string(quickbook::string_view(first.base(),
+                last.base() - first.base()), state.phrase.get());
         state.phrase << "</phrase>";
     }
 
@@ -70,15 +70,15 @@ namespace quickbook
             parse_iterator last, char const* name)
     {
         state.phrase << "<phrase role=\"" << name << "\">";
-        while (first != last)
-            detail::print_char(*first++, state.phrase.get());
+        detail::print_string(quickbook::string_view(first.base(),
+                last.base() - first.base()), state.phrase.get());
     }
 
     void syntax_highlight_actions::span_end(parse_iterator first,
             parse_iterator last)
     {
-        while (first != last)
-            detail::print_char(*first++, state.phrase.get());
+        detail::print_string(quickbook::string_view(first.base(),
+                last.base() - first.base()), state.phrase.get());
         state.phrase << "</phrase>";
     }
 
@@ -94,16 +94,16 @@ namespace quickbook
 
         // print out an unexpected character
         state.phrase << "<phrase role=\"error\">";
-        while (first != last)
-            detail::print_char(*first++, state.phrase.get());
+        detail::print_string(quickbook::string_view(first.base(),
+                last.base() - first.base()), state.phrase.get());
         state.phrase << "</phrase>";
     }
 
     void syntax_highlight_actions::plain_char(parse_iterator first,
             parse_iterator last)
     {
-        while (first != last)
-            detail::print_char(*first++, state.phrase.get());
+        detail::print_string(quickbook::string_view(first.base(),
+                last.base() - first.base()), state.phrase.get());
     }
 
     void syntax_highlight_actions::pre_escape_back(parse_iterator,
@@ -115,10 +115,10 @@ namespace quickbook
     void syntax_highlight_actions::post_escape_back(parse_iterator,
             parse_iterator)
     {
-        std::string tmp;
+        string_rope tmp;
         state.phrase.swap(tmp);
         state.pop_output(); // restore the stream
-        state.phrase << tmp;
+        state.phrase.splice(tmp);
     }
 
     void syntax_highlight_actions::do_macro(std::string const& v)
@@ -8,6 +8,7 @@
     http://www.boost.org/LICENSE_1_0.txt)
 =============================================================================*/
 #include "utils.hpp"
+#include "simd.hpp"
 
 #include <cctype>
 #include <cstring>
@@ -15,22 +16,45 @@
 
 namespace quickbook { namespace detail
 {
+    namespace
+    {
+        // Returns the entity for characters which need to be escaped, or
+        // null for characters that don't.
+        char const* xml_entity(char ch)
+        {
+            switch (ch)
+            {
+                case '<': return "&lt;";
+                case '>': return "&gt;";
+                case '&': return "&amp;";
+                case '"': return "&quot;";
+                default:  return 0;
+                // note &apos; is not included. see the curse of apos:
+                // http://fishbowl.pastiche.org/2003/07/01/the_curse_of_apos
+            }
+        }
+
+        char const* find_xml_special(char const* begin, char const* end)
+        {
+            return simd::find_any(begin, end, '<', '>', '&', '"');
+        }
+    }
+
     std::string encode_string(quickbook::string_view str)
     {
         std::string result;
         result.reserve(str.size());
 
-        for (string_iterator it = str.begin();
-            it != str.end(); ++it)
+        char const* it = str.data();
+        char const* end = it + str.size();
+
+        for (;;)
         {
-            switch (*it)
-            {
-                case '<': result += "&lt;";    break;
-                case '>': result += "&gt;";    break;
-                case '&': result += "&amp;";   break;
-                case '"': result += "&quot;";  break;
-                default:  result += *it;       break;
-            }
+            char const* special = find_xml_special(it, end);
+            result.append(it, special);
+            if (special == end) break;
+            result += xml_entity(*special);
+            it = special + 1;
         }
 
         return result;
@@ -38,24 +62,25 @@ namespace quickbook { namespace detail
 
     void print_char(char ch, std::ostream& out)
     {
-        switch (ch)
-        {
-            case '<': out << "&lt;";    break;
-            case '>': out << "&gt;";    break;
-            case '&': out << "&amp;";   break;
-            case '"': out << "&quot;";  break;
-            default:  out << ch;        break;
-            // note &apos; is not included. see the curse of apos:
-            // http://fishbowl.pastiche.org/2003/07/01/the_curse_of_apos
-        }
+        if (char const* entity = xml_entity(ch))
+            out << entity;
+        else
+            out << ch;
     }
 
+    // Writes runs of characters that don't need escaping in one go.
     void print_string(quickbook::string_view str, std::ostream& out)
     {
-        for (string_iterator cur = str.begin();
-            cur != str.end(); ++cur)
+        char const* it = str.data();
+        char const* end = it + str.size();
+
+        for (;;)
         {
-            print_char(*cur, out);
+            char const* special = find_xml_special(it, end);
+            out.write(it, special - it);
+            if (special == end) break;
+            out << xml_entity(*special);
+            it = special + 1;
         }
     }
 
@@ -10,6 +10,9 @@
 #include "files.hpp"
 #include <boost/current_function.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <new>
 
 #define UNDEFINED_ERROR() \
     throw value_undefined_method( \
@@ -40,25 +43,115 @@ namespace quickbook
 
     namespace detail
     {
-        value_node::value_node(tag_type t)
-            : ref_count_(0), tag_(t), next_() {
-        }        
-    
-        value_node::~value_node() {
+        value_node::value_node(kind_type k, tag_type t)
+            : ref_count_(0), tag_(t), next_(), kind_(k) {
         }
-        
-        file_ptr value_node::get_file() const { UNDEFINED_ERROR(); }
-        string_iterator value_node::get_position() const { UNDEFINED_ERROR(); }
-        int value_node::get_int() const { UNDEFINED_ERROR(); }
-        quickbook::string_view value_node::get_quickbook() const { UNDEFINED_ERROR(); }
-        std::string value_node::get_encoded() const { UNDEFINED_ERROR(); }
-        value_node* value_node::get_list() const { UNDEFINED_ERROR(); }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Value Arena
+
+    namespace
+    {
+        QUICKBOOK_THREAD_LOCAL value_arena* current_arena = 0;
+
+        // Stored before each node, so that it can be returned to the arena
+        // that allocated it. The union keeps the node aligned.
+        union node_header
+        {
+            value_arena* arena;
+            double align_;
+        };
+
+        std::size_t const arena_block_size = 32 * 1024;
+    }
+
+    value_arena::value_arena()
+        : blocks_()
+        , block_pos_(0)
+        , block_end_(0)
+        , live_(0)
+        , previous_(current_arena)
+    {
+        std::fill(free_, free_ + size_classes, static_cast<void*>(0));
+        current_arena = this;
+    }
+
+    value_arena::~value_arena()
+    {
+        assert(current_arena == this);
+        assert(!live_);
+        current_arena = previous_;
+
+        BOOST_FOREACH(char* block, blocks_) {
+            ::operator delete(block);
+        }
+    }
+
+    value_arena* value_arena::current()
+    {
+        return current_arena;
+    }
+
+    void* value_arena::allocate(std::size_t size)
+    {
+        std::size_t size_class = (size + granularity - 1) / granularity;
+        if (size_class >= size_classes) return ::operator new(size);
+
+        ++live_;
+
+        if (void* free = free_[size_class]) {
+            free_[size_class] = *static_cast<void**>(free);
+            return free;
+        }
+
+        std::size_t bytes = size_class * granularity;
 
-        bool value_node::empty() const { return false; }
-        bool value_node::check() const { return true; }
-        bool value_node::is_list() const { return false; }
-        bool value_node::is_encoded() const { return false; }
-        bool value_node::equals(value_node*) const { UNDEFINED_ERROR(); }
+        if (static_cast<std::size_t>(block_end_ - block_pos_) < bytes) {
+            // Any space left at the end of the old block is wasted.
+            blocks_.reserve(blocks_.size() + 1);
+            block_pos_ = static_cast<char*>(::operator new(arena_block_size));
+            block_end_ = block_pos_ + arena_block_size;
+            blocks_.push_back(block_pos_);
+        }
+
+        void* result = block_pos_;
+        block_pos_ += bytes;
+        return result;
+    }
+
+    void value_arena::deallocate(void* ptr, std::size_t size)
+    {
+        std::size_t size_class = (size + granularity - 1) / granularity;
+        if (size_class >= size_classes) return ::operator delete(ptr);
+
+        --live_;
+        *static_cast<void**>(ptr) = free_[size_class];
+        free_[size_class] = ptr;
+    }
+
+    namespace detail
+    {
+        void* value_node::operator new(std::size_t size)
+        {
+            std::size_t total = size + sizeof(node_header);
+            value_arena* arena = current_arena;
+            node_header* header = static_cast<node_header*>(arena ?
+                arena->allocate(total) : ::operator new(total));
+            header->arena = arena;
+            return header + 1;
+        }
+
+        void value_node::operator delete(void* ptr, std::size_t size)
+        {
+            if (!ptr) return;
+
+            node_header* header = static_cast<node_header*>(ptr) - 1;
+            if (header->arena)
+                header->arena->deallocate(header, size + sizeof(node_header));
+            else
+                ::operator delete(header);
+        }
     }
 
     ////////////////////////////////////////////////////////////////////////////
@@ -73,22 +166,11 @@ namespace quickbook
             static value_list_end_impl instance;
         private:
             value_list_end_impl()
-                : value_node(value::default_tag)
+                : value_node(list_end_kind, value::default_tag)
             {
-                intrusive_ptr_add_ref(&instance);
+                ref_count_ = -1;
                 next_ = this;
             }
-
-            virtual char const* type_name() const { return "list end"; }
-            virtual value_node* clone() const { UNDEFINED_ERROR(); }
-
-            virtual bool equals(value_node* other) const
-            { return this == other; }
-
-            bool empty() const { UNDEFINED_ERROR(); }
-            bool check() const { UNDEFINED_ERROR(); }
-            bool is_list() const { UNDEFINED_ERROR(); }
-            bool is_encoded() const { UNDEFINED_ERROR(); }
         };
 
         value_list_end_impl value_list_end_impl::instance;
@@ -106,26 +188,8 @@ namespace quickbook
         {
             static value_node* new_(value::tag_type t);
 
-        protected:
             explicit empty_value_impl(value::tag_type t)
-                : value_node(t) {}
-
-        private:
-            char const* type_name() const { return "empty"; }
-        
-            virtual value_node* clone() const
-                { return new empty_value_impl(tag_); }
-
-            virtual bool empty() const
-                { return true; }
-
-            virtual bool check() const
-                { return false; }
-
-            virtual bool equals(value_node* other) const
-                { return !other->check(); }
-            
-            friend value quickbook::empty_value(value::tag_type);
+                : value_node(empty_kind, t) {}
         };
     
         struct value_nil_impl : public empty_value_impl
@@ -135,7 +199,7 @@ namespace quickbook
             value_nil_impl()
                 : empty_value_impl(value::default_tag)
             {
-                intrusive_ptr_add_ref(&instance);
+                ref_count_ = -1;
                 next_ = &value_list_end_impl::instance;
             }
         };
@@ -145,7 +209,7 @@ namespace quickbook
         value_node* empty_value_impl::new_(value::tag_type t) {
             // The return value from this function is always placed in an
             // intrusive_ptr which will manage the memory correctly.
-            // Note that value_nil_impl increments its reference count
+            // Note that value_nil_impl sets its reference count to -1
             // in its constructor, so that it will never be deleted by the
             // intrusive pointer.
 
@@ -169,9 +233,8 @@ namespace quickbook
         value_counted::value_counted()
             : value_base(&value_nil_impl::instance)
         {
-            // Even though empty is not on the heap, its reference
-            // counter needs to be incremented so that the destructor
-            // doesn't try to delete it.
+            // Empty is not on the heap, so this doesn't actually change
+            // its reference count, but it's simpler to be consistent.
 
             intrusive_ptr_add_ref(value_);
         }
@@ -231,62 +294,43 @@ namespace quickbook
 
     ////////////////////////////////////////////////////////////////////////////
     // Integers
+    //
+    // The encoded form is stored in the node, so that get_encoded can
+    // return a view of it.
 
     namespace detail
     {
         struct int_value_impl : public value_node
         {
-        public:
-            explicit int_value_impl(int, value::tag_type);
-        private:
-            char const* type_name() const { return "integer"; }
-            virtual value_node* clone() const;
-            virtual int get_int() const;
-            virtual std::string get_encoded() const;
-            virtual bool empty() const;
-            virtual bool is_encoded() const;
-            virtual bool equals(value_node*) const;
+            int_value_impl(int, value::tag_type);
+
+            quickbook::string_view encoded() const
+                { return quickbook::string_view(text_, size_); }
 
             int value_;
+            unsigned char size_;
+            char text_[16];
         };
 
         int_value_impl::int_value_impl(int v, value::tag_type t)
-            : value_node(t)
+            : value_node(int_kind, t)
             , value_(v)
-        {}
-
-        value_node* int_value_impl::clone() const
+            , size_(0)
         {
-            return new int_value_impl(value_, tag_);
-        }
+            char buffer[sizeof(text_)];
+            char* end = buffer + sizeof(buffer);
+            char* begin = end;
 
-        int int_value_impl::get_int() const
-        {
-            return value_;
-        }
+            unsigned int x = v < 0 ? 0u - static_cast<unsigned int>(v) :
+                static_cast<unsigned int>(v);
+            do {
+                *--begin = static_cast<char>('0' + x % 10);
+                x /= 10;
+            } while (x);
+            if (v < 0) *--begin = '-';
 
-        std::string int_value_impl::get_encoded() const
-        {
-            return boost::lexical_cast<std::string>(value_);
-        }
-
-        bool int_value_impl::empty() const
-        {
-            return false;
-        }
-
-        bool int_value_impl::is_encoded() const
-        {
-            return true;
-        }
-
-        bool int_value_impl::equals(value_node* other) const {
-            try {
-                return value_ == other->get_int();
-            }
-            catch(value_undefined_method&) {
-                return false;
-            }
+            size_ = static_cast<unsigned char>(end - begin);
+            std::copy(begin, end, text_);
         }
     }
 
@@ -300,111 +344,77 @@ namespace quickbook
 
     namespace detail
     {
+        // The text is stored after the node.
         struct encoded_value_impl : public value_node
         {
-        public:
-            explicit encoded_value_impl(std::string const&, value::tag_type);
-        private:
-            char const* type_name() const { return "encoded text"; }
+            static encoded_value_impl* new_(
+                    quickbook::string_view, value::tag_type);
 
-            virtual ~encoded_value_impl();
-            virtual value_node* clone() const;
-            virtual std::string get_encoded() const;
-            virtual bool empty() const;
-            virtual bool is_encoded() const;
-            virtual bool equals(value_node*) const;
+            quickbook::string_view encoded() const
+            {
+                return quickbook::string_view(
+                    reinterpret_cast<char const*>(this + 1), size_);
+            }
 
-            std::string value_;
+            std::size_t size_;
+        private:
+            encoded_value_impl(quickbook::string_view, value::tag_type);
         };
     
         struct qbk_value_impl : public value_node
         {
-        public:
-            explicit qbk_value_impl(
+            qbk_value_impl(
                     file_ptr const&,
                     string_iterator begin,
                     string_iterator end,
                     value::tag_type);
-        private:
-            char const* type_name() const { return "quickbook"; }
-
-            virtual ~qbk_value_impl();
-            virtual value_node* clone() const;
-            virtual file_ptr get_file() const;
-            virtual string_iterator get_position() const;
-            virtual quickbook::string_view get_quickbook() const;
-            virtual bool empty() const;
-            virtual bool equals(value_node*) const;
 
             file_ptr file_;
             string_iterator begin_;
             string_iterator end_;
         };
     
+        // The encoded text is stored after the node.
         struct encoded_qbk_value_impl : public value_node
         {
-        private:
-            char const* type_name() const { return "encoded text with quickbook reference"; }
-
-            encoded_qbk_value_impl(file_ptr const&,
+            static encoded_qbk_value_impl* new_(file_ptr const&,
                     string_iterator, string_iterator,
-                    std::string const&, value::tag_type);
-    
-            virtual ~encoded_qbk_value_impl();
-            virtual value_node* clone() const;
-            virtual file_ptr get_file() const;
-            virtual string_iterator get_position() const;
-            virtual quickbook::string_view get_quickbook() const;
-            virtual std::string get_encoded() const;
-            virtual bool empty() const;
-            virtual bool is_encoded() const;
-            virtual bool equals(value_node*) const;
+                    quickbook::string_view, value::tag_type);
+
+            quickbook::string_view encoded() const
+            {
+                return quickbook::string_view(
+                    reinterpret_cast<char const*>(this + 1), size_);
+            }
 
             file_ptr file_;
             string_iterator begin_;
             string_iterator end_;
-            std::string encoded_value_;
-            
-            friend quickbook::value quickbook::encoded_qbk_value(
-                    file_ptr const&, string_iterator, string_iterator,
-                    std::string const&, quickbook::value::tag_type);
+            std::size_t size_;
+        private:
+            encoded_qbk_value_impl(file_ptr const&,
+                    string_iterator, string_iterator,
+                    quickbook::string_view, value::tag_type);
         };
 
         // encoded_value_impl
+
+        encoded_value_impl* encoded_value_impl::new_(
+                quickbook::string_view val,
+                value::tag_type tag)
+        {
+            void* memory = value_node::operator new(
+                sizeof(encoded_value_impl) + val.size());
+            return ::new (memory) encoded_value_impl(val, tag);
+        }
     
         encoded_value_impl::encoded_value_impl(
-                std::string const& val,
+                quickbook::string_view val,
                 value::tag_type tag
             )
-            : value_node(tag), value_(val)
-        {
-        }
-    
-        encoded_value_impl::~encoded_value_impl()
+            : value_node(encoded_kind, tag), size_(val.size())
         {
-        }
-
-        value_node* encoded_value_impl::clone() const
-        {
-            return new encoded_value_impl(value_, tag_);
-        }
-    
-        std::string encoded_value_impl::get_encoded() const
-            { return value_; }
-
-        bool encoded_value_impl::empty() const
-            { return value_.empty(); }
-
-        bool encoded_value_impl::is_encoded() const
-            { return true; }
-
-        bool encoded_value_impl::equals(value_node* other) const {
-            try {
-                return value_ == other->get_encoded();
-            }
-            catch(value_undefined_method&) {
-                return false;
-            }
+            std::copy(val.begin(), val.end(), reinterpret_cast<char*>(this + 1));
         }
 
         // qbk_value_impl
@@ -414,98 +424,39 @@ namespace quickbook
                 string_iterator begin,
                 string_iterator end,
                 value::tag_type tag
-            ) : value_node(tag), file_(f), begin_(begin), end_(end)
-        {
-        }
-    
-        qbk_value_impl::~qbk_value_impl()
-        {
-        }
-    
-        value_node* qbk_value_impl::clone() const
+            ) : value_node(qbk_kind, tag), file_(f), begin_(begin), end_(end)
         {
-            return new qbk_value_impl(file_, begin_, end_, tag_);
         }
 
-        file_ptr qbk_value_impl::get_file() const
-            { return file_; }
-
-        string_iterator qbk_value_impl::get_position() const
-            { return begin_; }
-
-        quickbook::string_view qbk_value_impl::get_quickbook() const
-            { return quickbook::string_view(begin_, end_ - begin_); }
+        // encoded_qbk_value_impl
 
-        bool qbk_value_impl::empty() const
-            { return begin_ == end_; }
-    
-        bool qbk_value_impl::equals(value_node* other) const {
-            try {
-                return this->get_quickbook() == other->get_quickbook();
-            }
-            catch(value_undefined_method&) {
-                return false;
-            }
+        encoded_qbk_value_impl* encoded_qbk_value_impl::new_(
+                file_ptr const& f,
+                string_iterator begin,
+                string_iterator end,
+                quickbook::string_view encoded,
+                value::tag_type tag)
+        {
+            void* memory = value_node::operator new(
+                sizeof(encoded_qbk_value_impl) + encoded.size());
+            return ::new (memory) encoded_qbk_value_impl(
+                f, begin, end, encoded, tag);
         }
-
-        // encoded_qbk_value_impl
     
         encoded_qbk_value_impl::encoded_qbk_value_impl(
                 file_ptr const& f,
                 string_iterator begin,
                 string_iterator end,
-                std::string const& encoded,
+                quickbook::string_view encoded,
                 value::tag_type tag)
-            : value_node(tag)
+            : value_node(encoded_qbk_kind, tag)
             , file_(f)
             , begin_(begin)
             , end_(end)
-            , encoded_value_(encoded)
-            
-        {
-        }
-    
-        encoded_qbk_value_impl::~encoded_qbk_value_impl()
-        {
-        }
-
-        value_node* encoded_qbk_value_impl::clone() const
+            , size_(encoded.size())
         {
-            return new encoded_qbk_value_impl(
-                    file_, begin_, end_, encoded_value_, tag_);
-        }
-
-        file_ptr encoded_qbk_value_impl::get_file() const
-            { return file_; }
-
-        string_iterator encoded_qbk_value_impl::get_position() const
-            { return begin_; }
-
-        quickbook::string_view encoded_qbk_value_impl::get_quickbook() const
-            { return quickbook::string_view(begin_, end_ - begin_); }
-
-        std::string encoded_qbk_value_impl::get_encoded() const
-            { return encoded_value_; }
-
-        // Should this test the quickbook, the boostbook or both?
-        bool encoded_qbk_value_impl::empty() const
-            { return encoded_value_.empty(); }
-
-        bool encoded_qbk_value_impl::is_encoded() const
-            { return true; }
-
-        bool encoded_qbk_value_impl::equals(value_node* other) const {
-            try {
-                return this->get_quickbook() == other->get_quickbook();
-            }
-            catch(value_undefined_method&) {}
-
-            try {
-                return this->get_encoded() == other->get_encoded();
-            }
-            catch(value_undefined_method&) {}
-
-            return false;
+            std::copy(encoded.begin(), encoded.end(),
+                reinterpret_cast<char*>(this + 1));
         }
     }
 
@@ -516,14 +467,14 @@ namespace quickbook
 
     value encoded_value(std::string const& x, value::tag_type t)
     {
-        return value(new detail::encoded_value_impl(x, t));
+        return value(detail::encoded_value_impl::new_(x, t));
     }
 
     value encoded_qbk_value(
             file_ptr const& f, string_iterator x, string_iterator y,
             std::string const& z, value::tag_type t)
     {
-        return value(new detail::encoded_qbk_value_impl(f,x,y,z,t));
+        return value(detail::encoded_qbk_value_impl::new_(f,x,y,z,t));
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -533,7 +484,6 @@ namespace quickbook
     {
     namespace {
         value_node** list_ref_back(value_node**);
-        void list_ref(value_node*);
         void list_unref(value_node*);
         value_node** merge_sort(value_node**);
         value_node** merge_sort(value_node**, int);
@@ -550,14 +500,6 @@ namespace quickbook
             return back;
         }
 
-        void list_ref(value_node* ptr)
-        {
-            while(ptr != &value_list_end_impl::instance) {
-                intrusive_ptr_add_ref(ptr);
-                ptr = ptr->next_;
-            }
-        }
-
         void list_unref(value_node* ptr)
         {
             while(ptr != &value_list_end_impl::instance) {
@@ -636,82 +578,283 @@ namespace quickbook
     {
         struct value_list_impl : public value_node
         {
-            value_list_impl(value::tag_type);
             value_list_impl(value_list_builder&, value::tag_type);
-        private:
-            value_list_impl(value_list_impl const&);
-
-            char const* type_name() const { return "list"; }
-
-            virtual ~value_list_impl();
-            virtual value_node* clone() const;
-            virtual bool empty() const;
-            virtual bool equals(value_node*) const;
 
-            virtual bool is_list() const;
-            virtual value_node* get_list() const;
+            ~value_list_impl();
     
             value_node* head_;
         };
-        
-        value_list_impl::value_list_impl(value::tag_type tag)
-            : value_node(tag), head_(&value_list_end_impl::instance)
-        {}
     
         value_list_impl::value_list_impl(value_list_builder& builder,
                 value::tag_type tag)
-            : value_node(tag), head_(builder.release())
+            : value_node(list_kind, tag), head_(builder.release())
         {
         }
 
-        value_list_impl::value_list_impl(value_list_impl const& x)
-            : value_node(x.tag_), head_(x.head_)
-        {
-            list_ref(head_);
-        }
-    
         value_list_impl::~value_list_impl()
         {
             list_unref(head_);
         }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Shared nodes
 
-        value_node* value_list_impl::clone() const
+    namespace detail
+    {
+        value_shared_node::value_shared_node(value_node* x)
+            : value_node(shared_kind, x->tag_), value_(x)
         {
-            return new value_list_impl(*this);
+            intrusive_ptr_add_ref(value_);
         }
 
-        bool value_list_impl::empty() const
+        value_shared_node::~value_shared_node()
         {
-            return head_ == &value_list_end_impl::instance;
+            intrusive_ptr_release(value_);
         }
-    
-        bool value_list_impl::is_list() const
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Node methods
+    //
+    // The list end node is only used to mark the end of lists, so most
+    // methods aren't defined for it.
+
+    namespace detail
+    {
+        char const* value_node::type_name() const
+        {
+            switch (kind_) {
+            case list_end_kind: return "list end";
+            case empty_kind: return "empty";
+            case int_kind: return "integer";
+            case encoded_kind: return "encoded text";
+            case qbk_kind: return "quickbook";
+            case encoded_qbk_kind:
+                return "encoded text with quickbook reference";
+            case list_kind: return "list";
+            case shared_kind: return "shared";
+            }
+
+            assert(false);
+            return "unknown";
+        }
+
+        file_ptr value_node::get_file() const
         {
-            return true;
+            switch (kind_) {
+            case qbk_kind:
+                return static_cast<qbk_value_impl const*>(this)->file_;
+            case encoded_qbk_kind:
+                return static_cast<encoded_qbk_value_impl const*>(this)->file_;
+            default:
+                UNDEFINED_ERROR();
+            }
         }
-    
-        value_node* value_list_impl::get_list() const
+
+        string_iterator value_node::get_position() const
         {
-            return head_;
+            switch (kind_) {
+            case qbk_kind:
+                return static_cast<qbk_value_impl const*>(this)->begin_;
+            case encoded_qbk_kind:
+                return static_cast<encoded_qbk_value_impl const*>(this)->begin_;
+            default:
+                UNDEFINED_ERROR();
+            }
         }
 
-        bool value_list_impl::equals(value_node* other) const {
-            value_node* x1;
+        quickbook::string_view value_node::get_quickbook() const
+        {
+            switch (kind_) {
+            case qbk_kind: {
+                qbk_value_impl const* x =
+                    static_cast<qbk_value_impl const*>(this);
+                return quickbook::string_view(x->begin_, x->end_ - x->begin_);
+            }
+            case encoded_qbk_kind: {
+                encoded_qbk_value_impl const* x =
+                    static_cast<encoded_qbk_value_impl const*>(this);
+                return quickbook::string_view(x->begin_, x->end_ - x->begin_);
+            }
+            default:
+                UNDEFINED_ERROR();
+            }
+        }
 
-            try {
-                 x1 = other->get_list();
+        quickbook::string_view value_node::get_encoded() const
+        {
+            switch (kind_) {
+            case int_kind:
+                return static_cast<int_value_impl const*>(this)->encoded();
+            case encoded_kind:
+                return static_cast<encoded_value_impl const*>(this)->encoded();
+            case encoded_qbk_kind:
+                return static_cast<encoded_qbk_value_impl const*>(this)
+                    ->encoded();
+            default:
+                UNDEFINED_ERROR();
             }
-            catch(value_undefined_method&) {
+        }
+
+        int value_node::get_int() const
+        {
+            if (kind_ != int_kind) UNDEFINED_ERROR();
+            return static_cast<int_value_impl const*>(this)->value_;
+        }
+
+        value_node* value_node::get_list() const
+        {
+            if (kind_ != list_kind) UNDEFINED_ERROR();
+            return static_cast<value_list_impl const*>(this)->head_;
+        }
+
+        bool value_node::check() const
+        {
+            if (kind_ == list_end_kind) UNDEFINED_ERROR();
+            return kind_ != empty_kind;
+        }
+
+        bool value_node::empty() const
+        {
+            switch (kind_) {
+            case empty_kind:
+                return true;
+            case int_kind:
                 return false;
+            case encoded_kind:
+                return !static_cast<encoded_value_impl const*>(this)->size_;
+            case qbk_kind: {
+                qbk_value_impl const* x =
+                    static_cast<qbk_value_impl const*>(this);
+                return x->begin_ == x->end_;
             }
+            // Should this test the quickbook, the boostbook or both?
+            case encoded_qbk_kind:
+                return !static_cast<encoded_qbk_value_impl const*>(this)->size_;
+            case list_kind:
+                return static_cast<value_list_impl const*>(this)->head_ ==
+                    &value_list_end_impl::instance;
+            default:
+                UNDEFINED_ERROR();
+            }
+        }
 
-            for(value_node *x2 = head_; x1 != x2; x1 = x1->next_, x2 = x2->next_)
+        bool value_node::is_list() const
+        {
+            if (kind_ == list_end_kind) UNDEFINED_ERROR();
+            return kind_ == list_kind;
+        }
+
+        bool value_node::is_encoded() const
+        {
+            if (kind_ == list_end_kind) UNDEFINED_ERROR();
+            return kind_ == int_kind || kind_ == encoded_kind ||
+                kind_ == encoded_qbk_kind;
+        }
+
+        namespace {
+            bool has_quickbook(value_node const* x)
             {
-                if (x2 == &value_list_end_impl::instance ||
-                    !x1->equals(x2)) return false;
+                return x->kind_ == value_node::qbk_kind ||
+                    x->kind_ == value_node::encoded_qbk_kind;
+            }
+
+            bool has_encoded(value_node const* x)
+            {
+                return x->kind_ == value_node::int_kind ||
+                    x->kind_ == value_node::encoded_kind ||
+                    x->kind_ == value_node::encoded_qbk_kind;
+            }
+        }
+
+        bool value_node::equals(value_node* other) const
+        {
+            switch (kind_) {
+            case list_end_kind:
+                return this == other;
+            case empty_kind:
+                return !other->check();
+            case int_kind:
+                return other->kind_ == int_kind &&
+                    get_int() == other->get_int();
+            case encoded_kind:
+                return has_encoded(other) &&
+                    get_encoded() == other->get_encoded();
+            case qbk_kind:
+                return has_quickbook(other) &&
+                    get_quickbook() == other->get_quickbook();
+            case encoded_qbk_kind:
+                if (has_quickbook(other))
+                    return get_quickbook() == other->get_quickbook();
+                else if (has_encoded(other))
+                    return get_encoded() == other->get_encoded();
+                else
+                    return false;
+            case list_kind: {
+                if (other->kind_ != list_kind) return false;
+
+                value_node* x1 = other->get_list();
+                for(value_node *x2 = get_list(); x1 != x2;
+                    x1 = x1->next_, x2 = x2->next_)
+                {
+                    if (x2 == &value_list_end_impl::instance ||
+                        !list_value(x1)->equals(list_value(x2))) return false;
+                }
+
+                return true;
+            }
+            case shared_kind:
+                return static_cast<value_shared_node const*>(this)
+                    ->value_->equals(other);
+            }
+
+            assert(false);
+            return false;
+        }
+
+        void value_node::destroy(value_node* x)
+        {
+            switch (x->kind_) {
+            case empty_kind:
+                static_cast<empty_value_impl*>(x)->~empty_value_impl();
+                value_node::operator delete(x, sizeof(empty_value_impl));
+                break;
+            case int_kind:
+                static_cast<int_value_impl*>(x)->~int_value_impl();
+                value_node::operator delete(x, sizeof(int_value_impl));
+                break;
+            case encoded_kind: {
+                std::size_t size = sizeof(encoded_value_impl) +
+                    static_cast<encoded_value_impl*>(x)->size_;
+                static_cast<encoded_value_impl*>(x)->~encoded_value_impl();
+                value_node::operator delete(x, size);
+                break;
+            }
+            case qbk_kind:
+                static_cast<qbk_value_impl*>(x)->~qbk_value_impl();
+                value_node::operator delete(x, sizeof(qbk_value_impl));
+                break;
+            case encoded_qbk_kind: {
+                std::size_t size = sizeof(encoded_qbk_value_impl) +
+                    static_cast<encoded_qbk_value_impl*>(x)->size_;
+                static_cast<encoded_qbk_value_impl*>(x)
+                    ->~encoded_qbk_value_impl();
+                value_node::operator delete(x, size);
+                break;
+            }
+            case list_kind:
+                static_cast<value_list_impl*>(x)->~value_list_impl();
+                value_node::operator delete(x, sizeof(value_list_impl));
+                break;
+            case shared_kind:
+                static_cast<value_shared_node*>(x)->~value_shared_node();
+                value_node::operator delete(x, sizeof(value_shared_node));
+                break;
+            default:
+                // The list end is never destroyed.
+                assert(false);
             }
-            
-            return true;
         }
     }
 
@@ -753,7 +896,7 @@ namespace quickbook
     
         void value_list_builder::append(value_node* item)
         {
-            if(item->next_) item = item->clone();
+            if(item->next_) item = new value_shared_node(list_value(item));
             intrusive_ptr_add_ref(item);
             item->next_ = *back_;
             *back_ = item;
@@ -13,6 +13,8 @@
 
 #include <utility>
 #include <string>
+#include <vector>
+#include <cstddef>
 #include <cassert>
 #include <stdexcept>
 #include <boost/scoped_ptr.hpp>
@@ -27,11 +29,18 @@ namespace quickbook
     struct value;
     struct value_builder;
     struct value_error;
+    struct value_arena;
 
     namespace detail
     {
         ////////////////////////////////////////////////////////////////////////
         // Node
+        //
+        // Nodes don't have virtual methods, instead 'kind_' says what type
+        // of node it is, and the methods switch on that. The data for each
+        // kind is stored in a struct derived from value_node, which are
+        // defined in values.cpp. Encoded text is stored directly after the
+        // node, in the same allocation.
     
         struct value_node
         {
@@ -42,38 +51,79 @@ namespace quickbook
         public:
             typedef int tag_type;
 
+            enum kind_type {
+                list_end_kind, empty_kind, int_kind, encoded_kind,
+                qbk_kind, encoded_qbk_kind, list_kind, shared_kind
+            };
+
         protected:
-            explicit value_node(tag_type);
-            virtual ~value_node();
+            value_node(kind_type, tag_type);
+            ~value_node() {}
 
         public:
-            virtual char const* type_name() const = 0;
-            virtual value_node* clone() const = 0;
-
-            virtual file_ptr get_file() const;
-            virtual string_iterator get_position() const;
-            virtual quickbook::string_view get_quickbook() const;
-            virtual std::string get_encoded() const;
-            virtual int get_int() const;
-
-            virtual bool check() const;
-            virtual bool empty() const;
-            virtual bool is_encoded() const;
-            virtual bool is_list() const;
-            virtual bool equals(value_node*) const;
-
-            virtual value_node* get_list() const;
+            char const* type_name() const;
+
+            file_ptr get_file() const;
+            string_iterator get_position() const;
+            quickbook::string_view get_quickbook() const;
+            quickbook::string_view get_encoded() const;
+            int get_int() const;
+
+            bool check() const;
+            bool empty() const;
+            bool is_encoded() const;
+            bool is_list() const;
+            bool equals(value_node*) const;
+
+            value_node* get_list() const;
+
+            // Nodes are allocated from the current thread's value_arena
+            // if there is one.
+            static void* operator new(std::size_t);
+            static void operator delete(void*, std::size_t);
+
+            // Destroy a node which was created with new, and free its
+            // memory.
+            static void destroy(value_node*);
             
             int ref_count_;
             const tag_type tag_;
             value_node* next_;
+            const kind_type kind_;
 
+            // Statically allocated nodes have a negative reference count,
+            // and are never counted, so that they can be shared between
+            // threads.
             friend void intrusive_ptr_add_ref(value_node* ptr)
-                { ++ptr->ref_count_; }
+                { if(ptr->ref_count_ >= 0) ++ptr->ref_count_; }
             friend void intrusive_ptr_release(value_node* ptr)
-                { if(--ptr->ref_count_ == 0) delete ptr; }
+                { if(ptr->ref_count_ > 0 && --ptr->ref_count_ == 0) destroy(ptr); }
         };
 
+        ////////////////////////////////////////////////////////////////////////
+        // Shared node
+        //
+        // A list is linked through its nodes' 'next_' pointers, so a node can
+        // only be directly in one list. When a node that's already in a list
+        // is added to another, the second list gets one of these instead,
+        // which refers to the original node. Iterators look through them,
+        // so they're never seen outside of the lists.
+
+        struct value_shared_node : public value_node
+        {
+            explicit value_shared_node(value_node*);
+            ~value_shared_node();
+
+            value_node* value_;
+        };
+
+        // The node that a list entry represents.
+        inline value_node* list_value(value_node* x)
+        {
+            return x->kind_ == value_node::shared_kind ?
+                static_cast<value_shared_node*>(x)->value_ : x;
+        }
+
         ////////////////////////////////////////////////////////////////////////
         // Value base
         //
@@ -117,6 +167,10 @@ namespace quickbook
             quickbook::string_view get_quickbook() const
             { return value_->get_quickbook(); }
             std::string get_encoded() const
+            { return value_->get_encoded().to_s(); }
+            // Doesn't copy the text, the view is valid for as long as the
+            // value is.
+            quickbook::string_view get_encoded_view() const
             { return value_->get_encoded(); }
             int get_int() const
             { return value_->get_int(); }
@@ -164,8 +218,10 @@ namespace quickbook
             friend bool operator==(iterator x, iterator y)
                 { return x.ptr_ == y.ptr_; }
             iterator& operator++() { ptr_ = ptr_->next_; return *this; }
-            value_ref operator*() const { return value_ref(ptr_); }
-            value_proxy operator->() const { return value_proxy(ptr_); }
+            value_ref operator*() const
+                { return value_ref(list_value(ptr_)); }
+            value_proxy operator->() const
+                { return value_proxy(list_value(ptr_)); }
         private:
             value_node* ptr_;
         };
@@ -288,6 +344,41 @@ namespace quickbook
         boost::scoped_ptr<value_builder> saved;
     };
 
+    ////////////////////////////////////////////////////////////////////////////
+    // Value Arena
+    //
+    // While an arena exists, the value nodes created on its thread are
+    // allocated from it, rather than from the heap. When a node is
+    // released, its memory is kept for reuse by the arena, and all the
+    // memory is freed together when the arena is destroyed. So every value
+    // created while the arena is in use must be destroyed before it is.
+    //
+    // Arenas can be nested, the most recently created one is used.
+
+    struct value_arena {
+        value_arena(value_arena const&);
+        value_arena& operator=(value_arena const&);
+    public:
+        value_arena();
+        ~value_arena();
+
+        void* allocate(std::size_t);
+        void deallocate(void*, std::size_t);
+
+        static value_arena* current();
+    private:
+        // Free lists for each allocation size, in units of
+        // 'granularity'. Larger nodes are allocated from the heap.
+        enum { granularity = 8, size_classes = 32 };
+
+        std::vector<char*> blocks_;
+        char* block_pos_;
+        char* block_end_;
+        void* free_[size_classes];
+        std::size_t live_;
+        value_arena* previous_;
+    };
+
     ////////////////////////////////////////////////////////////////////////////
     // Value Error
     //
@@ -0,0 +1,187 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+#include "watch.hpp"
+#include <stdexcept>
+
+#if defined(__linux__)
+
+#include "stream.hpp"
+#include <map>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <boost/filesystem/operations.hpp>
+#include <boost/foreach.hpp>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace quickbook
+{
+    namespace
+    {
+        uint32_t const watch_mask =
+            IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+            IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+        // How long to wait for further changes after the first one,
+        // in milliseconds.
+        int const settle_time = 100;
+    }
+
+    struct directory_watcher::impl
+    {
+        int fd;
+
+        // The names that each watched directory was added with. A
+        // directory can have several names, e.g. 'a' and 'b/../a'.
+        std::map<int, std::vector<fs::path> > directories;
+
+        impl() : fd(inotify_init1(IN_CLOEXEC)), directories()
+        {
+            if (fd < 0) {
+                throw std::runtime_error(
+                    std::string("Unable to watch for changes: ") +
+                    std::strerror(errno));
+            }
+        }
+
+        ~impl()
+        {
+            close(fd);
+        }
+
+        // Reads the waiting events, returns false if some were lost.
+        bool read_events(std::vector<watched_change>& changes)
+        {
+            // Aligned for 'inotify_event'.
+            union {
+                inotify_event event;
+                char data[4096];
+            } buffer;
+
+            ssize_t length = read(fd, buffer.data, sizeof(buffer.data));
+            if (length < 0) {
+                if (errno == EINTR || errno == EAGAIN) return true;
+                throw std::runtime_error(
+                    std::string("Error watching for changes: ") +
+                    std::strerror(errno));
+            }
+
+            bool complete = true;
+
+            for (char* it = buffer.data; it < buffer.data + length;)
+            {
+                inotify_event const& event =
+                    *reinterpret_cast<inotify_event*>(it);
+                it += sizeof(inotify_event) + event.len;
+
+                if (event.mask & IN_Q_OVERFLOW) {
+                    complete = false;
+                    continue;
+                }
+
+                std::map<int, std::vector<fs::path> >::iterator
+                    directory = directories.find(event.wd);
+                if (directory == directories.end()) continue;
+
+                BOOST_FOREACH(fs::path const& name, directory->second)
+                {
+                    watched_change change;
+                    change.path = name;
+                    if (event.len) change.path /= event.name;
+                    change.is_directory = event.len &&
+                        (event.mask & IN_ISDIR);
+                    changes.push_back(change);
+                }
+
+                if (event.mask & IN_IGNORED) {
+                    directories.erase(directory);
+                }
+            }
+
+            return complete;
+        }
+    };
+
+    directory_watcher::directory_watcher() : impl_(new impl()) {}
+    directory_watcher::~directory_watcher() {}
+
+    void directory_watcher::add(fs::path const& path)
+    {
+        fs::path directory = path;
+        boost::system::error_code ec;
+
+        while (!directory.empty() && !fs::is_directory(directory, ec)) {
+            directory = directory.parent_path();
+        }
+
+        int wd = inotify_add_watch(impl_->fd,
+            directory.empty() ? "." : directory.c_str(), watch_mask);
+
+        if (wd < 0) {
+            detail::outwarn(directory)
+                << "Unable to watch directory: "
+                << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        std::vector<fs::path>& names = impl_->directories[wd];
+        if (std::find(names.begin(), names.end(), directory) == names.end())
+            names.push_back(directory);
+    }
+
+    bool directory_watcher::wait(std::vector<watched_change>& changes)
+    {
+        bool complete = true;
+        pollfd poll_fd = { impl_->fd, POLLIN, 0 };
+        int timeout = -1;
+
+        for (;;)
+        {
+            int result = poll(&poll_fd, 1, timeout);
+
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(
+                    std::string("Error watching for changes: ") +
+                    std::strerror(errno));
+            }
+
+            if (result == 0) {
+                if (!changes.empty() || !complete) return complete;
+                timeout = -1;
+                continue;
+            }
+
+            complete = impl_->read_events(changes) && complete;
+            timeout = settle_time;
+        }
+    }
+}
+
+#else
+
+namespace quickbook
+{
+    struct directory_watcher::impl {};
+
+    directory_watcher::directory_watcher()
+    {
+        throw std::runtime_error(
+            "Watching for changes isn't supported on this platform.");
+    }
+
+    directory_watcher::~directory_watcher() {}
+    void directory_watcher::add(fs::path const&) {}
+    bool directory_watcher::wait(std::vector<watched_change>&)
+        { return false; }
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+#if !defined(BOOST_QUICKBOOK_WATCH_HPP)
+#define BOOST_QUICKBOOK_WATCH_HPP
+
+#include <vector>
+#include <boost/filesystem/path.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace quickbook
+{
+    namespace fs = boost::filesystem;
+
+    struct watched_change
+    {
+        fs::path path;
+        bool is_directory;
+    };
+
+    // Watches directories for changes to their contents. This is only
+    // implemented using inotify, so the constructor throws
+    // std::runtime_error on other platforms.
+    struct directory_watcher
+    {
+        directory_watcher();
+        ~directory_watcher();
+
+        // Watch a directory, or if it doesn't exist, its nearest existing
+        // parent, so that its creation will be noticed. An empty path is
+        // the current directory.
+        void add(fs::path const&);
+
+        // Wait for something to change, and add the paths that changed to
+        // 'changes', which will be reported using the same names that
+        // were used to watch their directories. Waits briefly after the
+        // first change, so that changes made together are returned
+        // together. Returns false if some changes might have been lost.
+        bool wait(std::vector<watched_change>& changes);
+
+        struct impl;
+    private:
+        directory_watcher(directory_watcher const&);
+        directory_watcher& operator=(directory_watcher const&);
+
+        boost::scoped_ptr<impl> impl_;
+    };
+}
+
+#endif
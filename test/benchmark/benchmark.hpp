@@ -0,0 +1,72 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+// Minimal timing helpers for the benchmarks, which aren't run as part
+// of the tests. They compare a new implementation with an old one.
+
+#if !defined(BOOST_QUICKBOOK_BENCHMARK_HPP)
+#define BOOST_QUICKBOOK_BENCHMARK_HPP
+
+#include <boost/chrono.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+namespace quickbook
+{
+namespace benchmark
+{
+    // Returns the quickest time for 'f', in seconds.
+    template <typename F>
+    double time(int iterations, F f)
+    {
+        typedef boost::chrono::steady_clock clock;
+        double best = 0;
+
+        for (int i = 0; i < iterations; ++i) {
+            clock::time_point start = clock::now();
+            f();
+            double t = boost::chrono::duration<double>(
+                clock::now() - start).count();
+            if (i == 0 || t < best) best = t;
+        }
+
+        return best;
+    }
+
+    inline void report(char const* name, double old_time, double new_time,
+            std::size_t bytes)
+    {
+        double megabytes = bytes / (1024.0 * 1024.0);
+
+        std::cout << std::left << std::setw(24) << name << std::right
+            << std::fixed << std::setprecision(1)
+            << " old: " << std::setw(8) << megabytes / old_time << " MB/s"
+            << " new: " << std::setw(8) << megabytes / new_time << " MB/s"
+            << " speedup: " << std::setprecision(2)
+            << old_time / new_time << "x" << std::endl;
+    }
+
+    // For benchmarks which measure the cost of an operation, rather than
+    // throughput.
+    inline void report_operations(char const* name, double old_time,
+            double new_time, std::size_t operations)
+    {
+        std::cout << std::left << std::setw(24) << name << std::right
+            << std::fixed << std::setprecision(1)
+            << " old: " << std::setw(8) << old_time * 1e9 / operations
+            << " ns"
+            << " new: " << std::setw(8) << new_time * 1e9 / operations
+            << " ns"
+            << " speedup: " << std::setprecision(2)
+            << old_time / new_time << "x" << std::endl;
+    }
+}
+}
+
+#endif
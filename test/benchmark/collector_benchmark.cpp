@@ -0,0 +1,136 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+// Compares 'collector' with the iostreams based version it replaced, by
+// pushing and popping output in the same way as template calls and table
+// cells.
+
+#include "benchmark.hpp"
+#include "collector.hpp"
+#include <stack>
+#include <boost/ref.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+namespace old_collector
+{
+    struct string_stream
+    {
+        typedef boost::iostreams::filtering_ostream ostream;
+
+        string_stream()
+            : buffer_ptr(new std::string())
+            , stream_ptr(new ostream(
+                boost::iostreams::back_inserter(*buffer_ptr.get())))
+        {}
+
+        std::ostream& get() const { return *stream_ptr.get(); }
+
+        void swap(std::string& other)
+        {
+            stream_ptr->flush();
+            std::swap(other, *buffer_ptr.get());
+        }
+
+        void append(std::string const& other)
+        {
+            stream_ptr->flush();
+            *buffer_ptr.get() += other;
+        }
+
+        boost::shared_ptr<std::string> buffer_ptr;
+        boost::shared_ptr<ostream> stream_ptr;
+    };
+
+    struct collector : boost::noncopyable
+    {
+        collector() : main(default_), top(default_) {}
+
+        void push()
+        {
+            streams.push(string_stream());
+            top = boost::ref(streams.top());
+        }
+
+        void pop()
+        {
+            streams.pop();
+            if (streams.empty())
+                top = boost::ref(main);
+            else
+                top = boost::ref(streams.top());
+        }
+
+        std::ostream& get() const { return top.get().get(); }
+        void swap(std::string& other) { top.get().swap(other); }
+        void append(std::string const& other) { top.get().append(other); }
+
+        std::stack<string_stream> streams;
+        string_stream default_;
+        boost::reference_wrapper<string_stream> main;
+        boost::reference_wrapper<string_stream> top;
+    };
+
+    template <typename T>
+    collector& operator<<(collector& out, T const& val)
+    {
+        out.get() << val;
+        return out;
+    }
+
+    inline collector& operator<<(collector& out, std::string const& val)
+    {
+        out.append(val);
+        return out;
+    }
+}
+
+int const cells = 100000;
+
+// Writes a cell into a pushed output, and then moves it into the parent
+// output, as 'to_value_scoped_action' does.
+template <typename Collector>
+struct write_cells
+{
+    std::string& result;
+
+    void operator()() const
+    {
+        Collector out;
+        std::string cell;
+
+        for (int i = 0; i < cells; ++i) {
+            out.push();
+            out << "<para>" << std::string("Cell text") << "</para>";
+            out.swap(cell);
+            out.pop();
+            out << "<entry>" << cell << "</entry>";
+            cell.clear();
+        }
+
+        out.swap(result);
+    }
+};
+
+int main()
+{
+    std::string old_result, new_result;
+    write_cells<old_collector::collector> old_f = { old_result };
+    write_cells<quickbook::collector> new_f = { new_result };
+
+    double old_time = quickbook::benchmark::time(10, old_f);
+    double new_time = quickbook::benchmark::time(10, new_f);
+
+    if (old_result != new_result) {
+        std::cerr << "Results don't match" << std::endl;
+        std::exit(1);
+    }
+
+    quickbook::benchmark::report_operations("push/pop", old_time, new_time,
+        cells);
+}
@@ -0,0 +1,92 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+// Compares 'normalize_newlines' with the character at a time loop that
+// the file loader used to use.
+
+#include "benchmark.hpp"
+#include "files.hpp"
+#include <iterator>
+
+template <typename InputIterator, typename OutputIterator>
+void old_normalize(InputIterator begin, InputIterator end,
+        OutputIterator out)
+{
+    while(begin != end) {
+        if(*begin == '\r') {
+            *out++ = '\n';
+            ++begin;
+            if(begin != end && *begin == '\n') ++begin;
+        }
+        else {
+            *out++ = *begin++;
+        }
+    }
+}
+
+std::string make_source(char const* newline)
+{
+    std::string line = "    std::string::size_type pos = text_start;";
+    std::string source;
+
+    while (source.size() < 1024 * 1024) {
+        source += line;
+        source += newline;
+    }
+
+    return source;
+}
+
+struct old_version
+{
+    std::string const& source;
+    std::string& result;
+
+    void operator()() const
+    {
+        result.clear();
+        old_normalize(source.begin(), source.end(),
+            std::back_inserter(result));
+    }
+};
+
+struct new_version
+{
+    std::string const& source;
+    std::string& result;
+
+    void operator()() const
+    {
+        result.clear();
+        quickbook::normalize_newlines(source, result);
+    }
+};
+
+void run(char const* name, std::string const& source)
+{
+    std::string old_result, new_result;
+    old_version old_f = { source, old_result };
+    new_version new_f = { source, new_result };
+
+    double old_time = quickbook::benchmark::time(20, old_f);
+    double new_time = quickbook::benchmark::time(20, new_f);
+
+    if (old_result != new_result) {
+        std::cerr << "Results don't match for " << name << std::endl;
+        std::exit(1);
+    }
+
+    quickbook::benchmark::report(name, old_time, new_time, source.size());
+}
+
+int main()
+{
+    run("LF", make_source("\n"));
+    run("CRLF", make_source("\r\n"));
+    run("CR", make_source("\r"));
+}
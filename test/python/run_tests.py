@@ -4,7 +4,7 @@
 # Distributed under the Boost Software License, Version 1.0.
 # (See accompanying file LICENSE_1_0.txt or http://www.boost.org/LICENSE_1_0.txt)
 
-import sys, os, subprocess, tempfile, re
+import sys, os, subprocess, tempfile, re, json, socket, signal, shutil, time
 
 def main(args, directory):
     if len(args) != 1:
@@ -46,6 +46,38 @@ def main(args, directory):
         extra_flags = ['--indent','4','--linewidth','60'],
         output_gold = 'simple_custom_pretty_print.xml')
 
+    # Build several documents in one process.
+
+    batch_entries = [
+        (['simple.qbk'], 'simple.xml'),
+        (['simple.qbk', '--no-pretty-print'], 'simple_no_pretty_print.xml'),
+        (['simple.qbk', '--indent', '4', '--linewidth', '60'],
+            'simple_custom_pretty_print.xml'),
+        (['simple.qbk', '--no-self-linked-headers'],
+            'simple_no_self_linked.xml')]
+
+    failures += run_batch(quickbook_command, batch_entries)
+    failures += run_batch(quickbook_command, batch_entries,
+        extra_flags = ['--jobs', '3'])
+
+    # Build different documents in parallel, so that the grammars for
+    # several documents are created and used at the same time.
+
+    parallel_entries = [(['../%s.quickbook' % name], '../%s.gold' % name)
+        for name in ['quickbook_manual-1_4', 'templates-1_5',
+            'templates-1_7', 'table-1_6', 'section-1_5', 'code_cpp-1_5',
+            'callouts-1_7', 'list_test-1_7', 'heading-1_1', 'anchor-1_6',
+            'xml_escape-1_5', 'elements-1_6', 'macro-1_6', 'link-1_7',
+            'variablelist-1_5', 'unicode_escape-1_5']]
+
+    failures += run_batch(quickbook_command, parallel_entries,
+        extra_flags = ['--jobs', '4'])
+
+    # Build several documents using server mode.
+
+    failures += run_server(quickbook_command, batch_entries)
+    failures += run_server_socket(quickbook_command)
+
     if failures == 0:
         print "Success"
     else:
@@ -136,6 +168,180 @@ def run_quickbook(quickbook_command, filename, output_gold = None,
 
     return failures
 
+def run_batch(quickbook_command, entries, extra_flags = None):
+    failures = 0
+
+    manifest_filename = temp_filename('.txt')
+    output_filenames = []
+
+    try:
+        manifest = open(manifest_filename, 'w')
+        try:
+            manifest.write('# Batch test\n\n')
+            for (args, output_gold) in entries:
+                output_filename = temp_filename('.qbk')
+                output_filenames.append(output_filename)
+                manifest.write(' '.join(args +
+                    ['--output-file', output_filename]) + '\n')
+        finally:
+            manifest.close()
+
+        command = [quickbook_command, '--debug', '--batch', manifest_filename]
+
+        if extra_flags:
+            command.extend(extra_flags)
+
+        print 'Running: ' + ' '.join(command)
+        print
+        exit_code = subprocess.call(command)
+        print
+
+        if exit_code:
+            failures = failures + 1
+            print "Batch failed."
+            print
+
+        for (output_filename, (args, output_gold)) in \
+                zip(output_filenames, entries):
+            gold = load_file(output_gold)
+            output = load_file(output_filename)
+            if gold != output:
+                failures = failures + 1
+                print "Output doesn't match for: " + ' '.join(args)
+                print
+                print gold
+                print
+                print output
+                print
+    finally:
+        os.unlink(manifest_filename)
+        for output_filename in output_filenames:
+            os.unlink(output_filename)
+
+    return failures
+
+def run_server(quickbook_command, entries):
+    failures = 0
+
+    output_filenames = []
+    requests = ''
+
+    try:
+        for (args, output_gold) in entries:
+            output_filename = temp_filename('.qbk')
+            output_filenames.append(output_filename)
+            requests += json.dumps({ 'input': args[0],
+                'output': output_filename, 'options': args[1:] }) + '\n'
+
+        command = [quickbook_command, '--debug', '--server']
+
+        print 'Running: ' + ' '.join(command)
+        print
+        process = subprocess.Popen(command,
+            stdin = subprocess.PIPE, stdout = subprocess.PIPE,
+            universal_newlines = True)
+        (responses, errors) = process.communicate(requests)
+        print
+
+        responses = [json.loads(r) for r in responses.splitlines()]
+
+        if process.returncode or len(responses) != len(entries):
+            failures = failures + 1
+            print "Server failed."
+            print
+
+        for (output_filename, response, (args, output_gold)) in \
+                zip(output_filenames, responses, entries):
+            gold = load_file(output_gold)
+            output = load_file(output_filename)
+            if not response['success'] or \
+                    response['dependencies'] != [args[0]]:
+                failures = failures + 1
+                print "Request failed for: " + ' '.join(args)
+                print
+                print response
+                print
+            if gold != output:
+                failures = failures + 1
+                print "Output doesn't match for: " + ' '.join(args)
+                print
+                print gold
+                print
+                print output
+                print
+    finally:
+        for output_filename in output_filenames:
+            os.unlink(output_filename)
+
+    return failures
+
+def run_server_socket(quickbook_command):
+    if not hasattr(socket, 'AF_UNIX'):
+        return 0
+
+    failures = 0
+    directory = tempfile.mkdtemp()
+    socket_path = os.path.join(directory, 'quickbook.sock')
+
+    try:
+        # The first server is killed, which leaves its socket behind, so
+        # the second has to replace it. The second is stopped cleanly, so
+        # should remove its socket.
+        for stop_signal in [signal.SIGKILL, signal.SIGTERM]:
+            command = [quickbook_command, '--server-socket', socket_path]
+
+            print 'Running: ' + ' '.join(command)
+            print
+            process = subprocess.Popen(command)
+
+            try:
+                connection = connect_to_server(socket_path, process)
+                if not connection:
+                    failures = failures + 1
+                    print "Server didn't start."
+                    print
+                    continue
+
+                stream = connection.makefile('rw')
+                stream.write(json.dumps({ 'input': 'simple.qbk' }) + '\n')
+                stream.flush()
+                response = json.loads(stream.readline())
+                stream.close()
+                connection.close()
+
+                if not response['success']:
+                    failures = failures + 1
+                    print "Request failed."
+                    print
+                    print response
+                    print
+            finally:
+                if process.poll() is None:
+                    process.send_signal(stop_signal)
+                process.wait()
+
+        if os.path.exists(socket_path):
+            failures = failures + 1
+            print "Server didn't remove its socket."
+            print
+    finally:
+        shutil.rmtree(directory)
+
+    return failures
+
+def connect_to_server(socket_path, process):
+    for attempt in range(100):
+        if process.poll() is not None:
+            return None
+        connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            connection.connect(socket_path)
+            return connection
+        except socket.error:
+            connection.close()
+            time.sleep(0.1)
+    return None
+
 def load_dependencies(filename):
     dependencies = set()
     f = open(filename, 'r')
@@ -0,0 +1,91 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+#include "collector.hpp"
+#include <boost/detail/lightweight_test.hpp>
+
+void rope_tests()
+{
+    std::string large(1000, 'x');
+
+    quickbook::string_rope r1;
+    BOOST_TEST(r1.empty());
+    r1.append("a");
+
+    // Small ropes are copied.
+    quickbook::string_rope r2;
+    r2.append("b");
+    r1.splice(r2);
+    BOOST_TEST(r2.empty());
+    BOOST_TEST_EQ(r1.str(), "ab");
+
+    // Large ones are linked.
+    quickbook::string_rope r3;
+    r3.append(large);
+    r1.splice(r3);
+    r1.append("c");
+    BOOST_TEST(r3.empty());
+    BOOST_TEST(!r1.empty());
+
+    std::string s = large;
+    r1.splice(s);
+    BOOST_TEST(s.empty());
+    BOOST_TEST_EQ(r1.str(), "ab" + large + "c" + large);
+
+    // Splicing onto an empty rope swaps.
+    quickbook::string_rope r4;
+    r4.splice(r1);
+    BOOST_TEST(r1.empty());
+    BOOST_TEST_EQ(r4.str(), "ab" + large + "c" + large);
+
+    std::string out;
+    r4.swap(out);
+    BOOST_TEST(r4.empty());
+    BOOST_TEST_EQ(out, "ab" + large + "c" + large);
+}
+
+void collector_tests()
+{
+    std::string large(1000, 'y');
+
+    quickbook::collector c;
+    c << "start" << 1 << ' ';
+
+    c.push();
+    c << large;
+    c.push();
+    c << "inner";
+    quickbook::string_rope inner;
+    c.swap(inner);
+    BOOST_TEST(c.empty());
+    c.pop();
+    c.splice(inner);
+    c << "end";
+    quickbook::string_rope outer;
+    c.swap(outer);
+    c.pop();
+
+    c.splice(outer);
+    BOOST_TEST_EQ(c.str(), "start1 " + large + "innerend");
+
+    // Pushed streams are empty, even when reused.
+    c.push();
+    BOOST_TEST(c.empty());
+    c.get() << "x" << 2;
+    BOOST_TEST_EQ(c.str(), "x2");
+    c.pop();
+
+    BOOST_TEST_EQ(c.str(), "start1 " + large + "innerend");
+}
+
+int main()
+{
+    rope_tests();
+    collector_tests();
+    return boost::report_errors();
+}
@@ -0,0 +1,65 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+#include "dependency_tracker.hpp"
+#include <boost/detail/lightweight_test.hpp>
+
+void affected_by_tests()
+{
+    using boost::filesystem::path;
+
+    quickbook::dependency_tracker d;
+    d.add_dependency(path("missing/a.qbk"));
+    d.add_dependency(path("b.qbk"));
+    d.add_glob(path("parts/*.qbk"));
+    d.add_glob(path("sub*/x\\[1\\].qbk"));
+
+    BOOST_TEST(d.affected_by(path("missing/a.qbk")));
+    BOOST_TEST(d.affected_by(path("missing")));
+    BOOST_TEST(d.affected_by(path("b.qbk")));
+    BOOST_TEST(!d.affected_by(path("a.qbk")));
+    BOOST_TEST(!d.affected_by(path("missing/b.qbk")));
+    BOOST_TEST(!d.affected_by(path("b.qbk/c")));
+
+    BOOST_TEST(d.affected_by(path("parts")));
+    BOOST_TEST(d.affected_by(path("parts/new.qbk")));
+    BOOST_TEST(!d.affected_by(path("parts/new.txt")));
+    BOOST_TEST(!d.affected_by(path("parts/sub/new.qbk")));
+
+    BOOST_TEST(d.affected_by(path("sub1")));
+    BOOST_TEST(d.affected_by(path("sub1/x[1].qbk")));
+    BOOST_TEST(!d.affected_by(path("sub1/x1.qbk")));
+    BOOST_TEST(!d.affected_by(path("other/x[1].qbk")));
+}
+
+void get_directories_tests()
+{
+    using boost::filesystem::path;
+
+    quickbook::dependency_tracker d;
+    d.add_dependency(path("missing/a.qbk"));
+    d.add_dependency(path("b.qbk"));
+    d.add_glob(path("parts/*.qbk"));
+    d.add_glob(path("x/sub*/*.qbk"));
+    d.add_glob_match(path("x/sub1/a.qbk"));
+
+    std::set<path> directories = d.get_directories();
+    BOOST_TEST_EQ(directories.size(), 5u);
+    BOOST_TEST(directories.count(path("")));
+    BOOST_TEST(directories.count(path("missing")));
+    BOOST_TEST(directories.count(path("parts")));
+    BOOST_TEST(directories.count(path("x")));
+    BOOST_TEST(directories.count(path("x/sub1")));
+}
+
+int main()
+{
+    affected_by_tests();
+    get_directories_tests();
+    return boost::report_errors();
+}
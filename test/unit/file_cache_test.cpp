@@ -0,0 +1,175 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+#include "files.hpp"
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/detail/lightweight_test.hpp>
+
+namespace fs = boost::filesystem;
+
+void write_file(fs::path const& path, std::string const& contents)
+{
+    fs::ofstream out(path, std::ios::binary);
+    out << contents;
+}
+
+void reload_tests(fs::path const& directory)
+{
+    fs::path a = directory / "a.qbk";
+
+    write_file(a, "Hello");
+    quickbook::file_ptr f1 = quickbook::load(a);
+    BOOST_TEST_EQ(f1->source(), "Hello");
+
+    // Unchanged files aren't read again.
+    quickbook::file_ptr f2 = quickbook::load(a);
+    BOOST_TEST(f1->source().data() == f2->source().data());
+
+    // Changed files are.
+    write_file(a, "Goodbye\r\n");
+    quickbook::file_ptr f3 = quickbook::load(a);
+    BOOST_TEST_EQ(f3->source(), "Goodbye\n");
+    BOOST_TEST_EQ(f1->source(), "Hello");
+
+    // Including when the size doesn't change, and it's within the
+    // resolution of the modification time.
+    write_file(a, "Teh");
+    BOOST_TEST_EQ(quickbook::load(a)->source(), "Teh");
+    write_file(a, "The");
+    BOOST_TEST_EQ(quickbook::load(a)->source(), "The");
+}
+
+void shared_contents_tests(fs::path const& directory)
+{
+    fs::path a = directory / "shared1.qbk";
+    fs::path b = directory / "shared2.qbk";
+    fs::path c = directory / "shared3.qbk";
+
+    write_file(a, "Same contents\n");
+    write_file(b, "Same contents\r\n");
+    write_file(c, "Other contents\n");
+
+    quickbook::file_ptr fa = quickbook::load(a);
+    quickbook::file_ptr fb = quickbook::load(b);
+    quickbook::file_ptr fc = quickbook::load(c);
+
+    BOOST_TEST(fa->source().data() == fb->source().data());
+    BOOST_TEST(fa->source().data() != fc->source().data());
+    BOOST_TEST_EQ(fb->source(), "Same contents\n");
+    BOOST_TEST_EQ(fc->source(), "Other contents\n");
+}
+
+// Writes over the start of a file, without truncating it, like an
+// editor which saves in place.
+void overwrite_file(fs::path const& path, std::string const& contents)
+{
+    fs::fstream out(path, std::ios::in | std::ios::out | std::ios::binary);
+    out << contents;
+}
+
+// Long enough to be mapped into memory, when that's allowed.
+std::string large_contents(char c)
+{
+    return std::string(100 * 1024, c) + "\n";
+}
+
+void map_files_tests(fs::path const& directory)
+{
+    fs::path a = directory / "large1.qbk";
+    std::string original = large_contents('a');
+
+    // Files which are read into memory don't change when they're
+    // modified on disk.
+    quickbook::set_map_files(false);
+
+    write_file(a, original);
+    quickbook::file_ptr f1 = quickbook::load(a);
+    overwrite_file(a, "CHANGED");
+    BOOST_TEST(f1->source() == original);
+
+    quickbook::set_map_files(true);
+}
+
+void shared_mapped_contents_tests(fs::path const& directory)
+{
+    fs::path a = directory / "large2.qbk";
+    fs::path b = directory / "large3.qbk";
+    std::string original = large_contents('b');
+
+    // Mapped files aren't shared, so a file doesn't change when another
+    // file with the same contents is modified.
+    write_file(a, original);
+    write_file(b, original);
+    quickbook::file_ptr fa = quickbook::load(a);
+    quickbook::file_ptr fb = quickbook::load(b);
+
+    overwrite_file(a, "CHANGED");
+    BOOST_TEST(fb->source() == original);
+    BOOST_TEST(quickbook::load(b)->source() == original);
+}
+
+// Changes the contents of a file, without changing its size or
+// modification time.
+void sneaky_write_file(fs::path const& path, std::string const& contents)
+{
+    std::time_t t = fs::last_write_time(path);
+    write_file(path, contents);
+    fs::last_write_time(path, t);
+}
+
+void sneaky_write_tests(fs::path const& directory)
+{
+    fs::path a = directory / "sneaky.qbk";
+
+    write_file(a, "First file");
+    BOOST_TEST_EQ(quickbook::load(a)->source(), "First file");
+    sneaky_write_file(a, "First FILE");
+    BOOST_TEST_EQ(quickbook::load(a)->source(), "First FILE");
+}
+
+void limit_tests(fs::path const& directory)
+{
+    fs::path a = directory / "limit1.qbk";
+    fs::path b = directory / "limit2.qbk";
+
+    // Large files are mapped, and mapped files aren't shared, so a file
+    // that's read again has new storage.
+    write_file(a, large_contents('c'));
+    write_file(b, large_contents('d'));
+
+    quickbook::set_file_cache_limit(150 * 1024);
+
+    quickbook::file_ptr f1 = quickbook::load(a);
+    BOOST_TEST(quickbook::load(a)->source().data() == f1->source().data());
+
+    // Loading 'b' pushes 'a' out of the cache, so it's read again.
+    quickbook::file_ptr f2 = quickbook::load(b);
+    quickbook::file_ptr f3 = quickbook::load(a);
+    BOOST_TEST(f3->source().data() != f1->source().data());
+    BOOST_TEST(f3->source() == large_contents('c'));
+
+    quickbook::set_file_cache_limit(256 * 1024 * 1024);
+}
+
+int main()
+{
+    fs::path directory = fs::temp_directory_path() /
+        fs::unique_path("quickbook-file-cache-%%%%-%%%%");
+    fs::create_directories(directory);
+
+    reload_tests(directory);
+    shared_contents_tests(directory);
+    map_files_tests(directory);
+    shared_mapped_contents_tests(directory);
+    sneaky_write_tests(directory);
+    limit_tests(directory);
+
+    fs::remove_all(directory);
+    return boost::report_errors();
+}
@@ -0,0 +1,67 @@
+/*=============================================================================
+    Copyright (c) 2017 Daniel James
+
+    Use, modification and distribution is subject to the Boost Software
+    License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at
+    http://www.boost.org/LICENSE_1_0.txt)
+=============================================================================*/
+
+#include "files.hpp"
+#include <boost/detail/lightweight_test.hpp>
+
+std::string normalize(std::string const& x)
+{
+    std::string result;
+    quickbook::normalize_newlines(x, result);
+    return result;
+}
+
+void simple_tests()
+{
+    BOOST_TEST_EQ(normalize(""), "");
+    BOOST_TEST_EQ(normalize("a"), "a");
+    BOOST_TEST_EQ(normalize("\r"), "\n");
+    BOOST_TEST_EQ(normalize("\n"), "\n");
+    BOOST_TEST_EQ(normalize("\r\n"), "\n");
+    BOOST_TEST_EQ(normalize("\n\r"), "\n\n");
+    BOOST_TEST_EQ(normalize("\r\r\n\n"), "\n\n\n");
+    BOOST_TEST_EQ(normalize("a\r\nb\rc\nd"), "a\nb\nc\nd");
+}
+
+// Check that newlines are handled wherever they are in a block.
+void block_boundary_tests()
+{
+    for (std::size_t length = 0; length < 100; ++length)
+    {
+        for (std::size_t pos = 0; pos < length; ++pos)
+        {
+            std::string text(length, 'x');
+            std::string expected(length, 'x');
+
+            text[pos] = '\r';
+            expected[pos] = '\n';
+            BOOST_TEST_EQ(normalize(text), expected);
+
+            if (pos + 1 < length) {
+                text[pos + 1] = '\n';
+                expected.erase(pos + 1, 1);
+                BOOST_TEST_EQ(normalize(text), expected);
+            }
+        }
+    }
+}
+
+void append_test()
+{
+    std::string result = "abc";
+    quickbook::normalize_newlines("\r\ndef", result);
+    BOOST_TEST_EQ(result, "abc\ndef");
+}
+
+int main()
+{
+    simple_tests();
+    block_boundary_tests();
+    append_test();
+    return boost::report_errors();
+}
@@ -8,6 +8,7 @@
 
 #include "post_process.hpp"
 #include <boost/detail/lightweight_test.hpp>
+#include <sstream>
 
 #define EXPECT_EXCEPTION(test, msg) \
     try { \
@@ -17,14 +18,90 @@
     catch(quickbook::post_process_failure&) { \
     }
 
+void formatting_tests()
+{
+    // Block tags are indented, flow tags and text are wrapped.
+    BOOST_TEST_EQ(
+        quickbook::post_process(
+            "<section id=\"a\"><title>Title</title>"
+            "<para>one  two\n three four five</para></section>", 2, 10),
+        std::string("<section id=\"a\">\n  <title>Title</title>\n"
+        "  <para>\n    one two\n    three four\n    five\n  </para>\n"
+        "</section>\n"));
+
+    // Spaces in strings aren't changed.
+    BOOST_TEST_EQ(
+        quickbook::post_process("<link href=\"a  b\">x</link>", 2, 1),
+        std::string("<link\n href=\"a  b\">x</link>"));
+
+    // Code keeps its spacing, but line endings are normalized.
+    BOOST_TEST_EQ(
+        quickbook::post_process(
+            "<programlisting>a  \r\nb\rc\n</programlisting>"),
+        std::string("\n<programlisting>a\nb\nc\n</programlisting>\n"));
+
+    // Escaped text is written as is.
+    BOOST_TEST_EQ(
+        quickbook::post_process(
+            "<para><!--quickbook-escape-prefix-->  <raw>  x "
+            "<!--quickbook-escape-postfix-->  </para>"),
+        std::string("<para>\n  <raw>  x</para>\n"));
+
+    // Comments are formatted like the last tag.
+    BOOST_TEST_EQ(
+        quickbook::post_process(
+            "<para>x</para><!-- a --><phrase>y</phrase><!-- b -->"),
+        std::string(
+            "<para>\n  x\n</para>\n<!-- a -->\n<phrase>y</phrase><!-- b -->"));
+}
+
+void stream_tests()
+{
+    // Long enough that the output is written in several chunks.
+    std::string xml = "<section>";
+    for (int i = 0; i < 5000; ++i) {
+        xml += "<para>Some  text, <phrase>and more   text</phrase>.</para>"
+            "<programlisting>code  \n  more code</programlisting>"
+            "<!--quickbook-escape-prefix--> <x>  </x> "
+            "<!--quickbook-escape-postfix--> ";
+    }
+    xml += "</section>";
+
+    for (int linewidth = 0; linewidth < 100; linewidth += 20) {
+        std::string expected = quickbook::post_process(xml, 2, linewidth);
+
+        std::ostringstream out;
+        quickbook::post_process(xml, out, 2, linewidth);
+        BOOST_TEST(out.str() == expected);
+
+        // Split into parts which are processed in parallel.
+        std::ostringstream parallel_out;
+        quickbook::post_process(xml, parallel_out, 2, linewidth, 4);
+        BOOST_TEST(parallel_out.str() == expected);
+    }
+
+    // The document is checked before anything is written.
+    std::ostringstream failed_out;
+    EXPECT_EXCEPTION(
+        quickbook::post_process(xml + "</section>", failed_out, 2, 80, 4),
+        "Succeeded with unbalanced tag");
+    BOOST_TEST(failed_out.str().empty());
+}
+
 int main()
 {
+    formatting_tests();
+    stream_tests();
+
     EXPECT_EXCEPTION(
         quickbook::post_process("</thing>"),
         "Succeeded with unbalanced tag");
     EXPECT_EXCEPTION(
         quickbook::post_process("<"),
         "Succeeded with badly formed tag");
+    EXPECT_EXCEPTION(
+        quickbook::post_process("<programlisting>x</programlisting> "),
+        "Succeeded with trailing space after code");
 
     return boost::report_errors();
 }
@@ -11,6 +11,7 @@
 #include <boost/detail/lightweight_test.hpp>
 
 #include <iostream>
+#include <sstream>
 
 void linkify_test() {
     using quickbook::detail::linkify;
@@ -27,6 +28,36 @@ void linkify_test() {
 void encode_string_test() {
     using quickbook::detail::encode_string;
     BOOST_TEST_EQ(std::string("&lt;A&amp;B&gt;"), encode_string("<A&B>"));
+    BOOST_TEST_EQ(std::string(""), encode_string(""));
+    BOOST_TEST_EQ(std::string("&quot;'"), encode_string("\"'"));
+
+    // Long enough to be scanned in blocks.
+    std::string plain(100, 'x');
+    BOOST_TEST_EQ(plain, encode_string(plain));
+    BOOST_TEST_EQ(plain + "&amp;" + plain + "&lt;",
+        encode_string(plain + "&" + plain + "<"));
+}
+
+void print_string_test() {
+    std::string text;
+    std::string expected;
+
+    for (int i = 0; i < 200; ++i) {
+        char c = static_cast<char>(' ' + i % 95);
+        text += c;
+        switch (c) {
+            case '<': expected += "&lt;"; break;
+            case '>': expected += "&gt;"; break;
+            case '&': expected += "&amp;"; break;
+            case '"': expected += "&quot;"; break;
+            default: expected += c;
+        }
+    }
+
+    std::ostringstream out;
+    quickbook::detail::print_string(text, out);
+    BOOST_TEST_EQ(expected, out.str());
+    BOOST_TEST_EQ(expected, quickbook::detail::encode_string(text));
 }
 
 void escape_uri_test() {
@@ -40,6 +71,7 @@ void escape_uri_test() {
 int main() {
     linkify_test();
     encode_string_test();
+    print_string_test();
     escape_uri_test();
     return boost::report_errors();
 }
@@ -86,6 +86,47 @@ void multiple_list_test()
     BOOST_TEST(!l2.check());
 }
 
+void shared_list_test()
+{
+    quickbook::value_builder list1;
+    list1.insert(quickbook::encoded_value("a", 5));
+    list1.insert(quickbook::value());
+    quickbook::value v1 = list1.release();
+
+    // Adding the values to other lists doesn't copy them, and they keep
+    // their original tags when sorted.
+    quickbook::value_builder list2;
+    list2.insert(quickbook::encoded_value("b", 2));
+    list2.extend(v1);
+    list2.sort_list();
+    quickbook::value v2 = list2.release();
+
+    quickbook::value_builder list3;
+    list3.extend(v2);
+    list3.insert(v1);
+    quickbook::value v3 = list3.release();
+
+    quickbook::value_consumer c1 = v1;
+    quickbook::value a = c1.consume(5);
+    BOOST_TEST(c1.consume(0).empty());
+    BOOST_TEST(!c1.check());
+
+    quickbook::value_consumer c2 = v2;
+    BOOST_TEST(c2.consume(0).empty());
+    BOOST_TEST_EQ(c2.consume(2).get_encoded(), "b");
+    BOOST_TEST(c2.consume(5).get_encoded_view().data() ==
+        a.get_encoded_view().data());
+    BOOST_TEST(!c2.check());
+
+    quickbook::value_consumer c3 = v3;
+    c3.consume(0);
+    c3.consume(2);
+    BOOST_TEST(c3.consume(5).get_encoded_view().data() ==
+        a.get_encoded_view().data());
+    BOOST_TEST(c3.consume() == v1);
+    BOOST_TEST(!c3.check());
+}
+
 void equality_tests()
 {
     std::vector<quickbook::value> distinct_values;
@@ -113,13 +154,93 @@ void equality_tests()
             }
 }
 
+void encoded_tests()
+{
+    quickbook::value x = quickbook::encoded_value("encoded");
+    BOOST_TEST(x.is_encoded());
+    BOOST_TEST_EQ(x.get_encoded(), "encoded");
+    BOOST_TEST_EQ(x.get_encoded_view(), quickbook::string_view("encoded"));
+
+    quickbook::value e = quickbook::encoded_value("");
+    BOOST_TEST(e.empty());
+    BOOST_TEST(e.check());
+
+    quickbook::value i = quickbook::int_value(-2147483647 - 1);
+    BOOST_TEST(i.is_encoded());
+    BOOST_TEST_EQ(i.get_int(), -2147483647 - 1);
+    BOOST_TEST_EQ(i.get_encoded(), "-2147483648");
+    BOOST_TEST_EQ(quickbook::int_value(0).get_encoded(), "0");
+    BOOST_TEST_EQ(quickbook::int_value(205).get_encoded(), "205");
+    BOOST_TEST(quickbook::int_value(10) == quickbook::int_value(10));
+    BOOST_TEST(quickbook::encoded_value("10") == quickbook::int_value(10));
+    BOOST_TEST(!(quickbook::int_value(10) == quickbook::encoded_value("10")));
+}
+
+void arena_tests()
+{
+    quickbook::value outside = quickbook::encoded_value("outside");
+
+    {
+        quickbook::value_arena arena;
+        BOOST_TEST(quickbook::value_arena::current() == &arena);
+
+        {
+            quickbook::value_builder b;
+            b.insert(quickbook::encoded_value("a", 3));
+            b.insert(outside);
+            b.insert(quickbook::int_value(10, 1));
+            b.insert(quickbook::encoded_value(std::string(1000, 'x'), 2));
+            b.sort_list();
+
+            quickbook::value list = b.release();
+            quickbook::value copy;
+
+            {
+                // Values can be added to several lists.
+                quickbook::value_builder b2;
+                b2.insert(list);
+                b2.insert(list);
+                copy = b2.release();
+            }
+
+            quickbook::value_consumer c = list;
+            BOOST_TEST_EQ(c.consume(0).get_encoded(), "outside");
+            BOOST_TEST_EQ(c.consume(1).get_int(), 10);
+            BOOST_TEST_EQ(c.consume(2).get_encoded().size(), 1000u);
+            BOOST_TEST_EQ(c.consume(3).get_encoded(), "a");
+            BOOST_TEST(!c.check());
+
+            quickbook::value_consumer c2 = copy;
+            BOOST_TEST(c2.consume() == list);
+            BOOST_TEST(c2.consume() == list);
+            BOOST_TEST(!c2.check());
+        }
+
+        {
+            // Nested arenas.
+            quickbook::value_arena arena2;
+            BOOST_TEST(quickbook::value_arena::current() == &arena2);
+            quickbook::value x = quickbook::encoded_value("x");
+            BOOST_TEST_EQ(x.get_encoded(), "x");
+        }
+
+        BOOST_TEST(quickbook::value_arena::current() == &arena);
+    }
+
+    BOOST_TEST(!quickbook::value_arena::current());
+    BOOST_TEST_EQ(outside.get_encoded(), "outside");
+}
+
 int main()
 {
     empty_tests();
     qbk_tests();
     sort_test();
     multiple_list_test();
+    shared_list_test();
     equality_tests();
+    encoded_tests();
+    arena_tests();
 
     return boost::report_errors();
 }